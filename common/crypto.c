@@ -1,5 +1,5 @@
 /*
- * crypto function to calculate SHA256 and CRC32
+ * crypto function to calculate SHA256
  *
  * Copyright (C) 2025, Liang Cheng
  *
@@ -28,8 +28,15 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <assert.h>
+#include <stdbool.h>
 #include <endian.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86      1
+#endif
+
+#include "crypto.h"
 
 /* for test crypto function only */
 #define DEBUG           0
@@ -48,10 +55,6 @@
 #define DLT0_256(x)     (ROTR(x, 7) ^ ROTR(x, 18) ^ SHR(x, 3))
 #define DLT1_256(x)     (ROTR(x, 17) ^ ROTR(x, 19) ^ SHR(x, 10))
 
-struct m_block_t {
-    uint32_t m[16]; /* M[0] ~ M[15] */
-};
-
 static uint32_t Ch(uint32_t x, uint32_t y, uint32_t z) {
     return (x & y) ^ ((~x) & z);
 }
@@ -60,76 +63,35 @@ static uint32_t Maj(uint32_t x, uint32_t y, uint32_t z) {
     return ((x & y) ^ (x & z) ^ (y & z));
 }
 
-/* len is in bytes */
-void calc_sha256(uint8_t *p_msg, uint32_t len, uint32_t *p_sha) {
-    uint32_t n_patch = 0;
-    uint32_t byte_n;
-    uint8_t *p_new = NULL;
-    // first 32 bits of the fractional parts of the cube roots of the first 64 primes
-    const static uint32_t K[64] = {
-        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-    };
-    // first 32 bits of the fractional parts of the square roots of the first 8 primes
-    // XXX: do_NOT_declare H as static as this array changes over the time.
-    // It can have negative impact on subsequent call.
-    uint32_t H[8] ={
-        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
-        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
-    };
-    struct m_block_t *p_m_block;
-    uint32_t i, t, N;
-    uint32_t W[64] = {0};
-
-    /* Step 1: --- pre-processing --- */
-    /* padding: msg + 0b1 + 0b0 + .... + (64 bit) of len */
-    /* calculate the number of zeroes padding */
-    n_patch = ((len * 8 + 1 + 64) / 512 + 1)* 512 - (len * 8 + 1 + 64);
-    while ((len * 8 + 1 + n_patch + 64) % 512 != 0) {
-        n_patch++;
-    }
-    /* (n_patch + 1) is diviable by 8 */
-    assert((n_patch + 1) % 8 == 0);
-    byte_n = len + (n_patch + 1) / 8 + 64 / 8;
-#if DEBUG
-    printf(" len = %d n_patch bits = %d byte_n = %d\n", len, n_patch, byte_n);
-#endif
-
-    assert((byte_n % 64) == 0);
-
-    p_new = malloc(byte_n);
-    memset(p_new, 0, byte_n);
-    memcpy(p_new, p_msg, len);
-    *((char *)p_new + len) = 0x80;
-    {
-        /* padding the bits of len */
-        uint32_t val;
-        val = len * 8;
-        i = 1;
-        while (val != 0) {
-            *(p_new + byte_n - i) = val & 0xFF;
-            val = val >> 8;
-            i++;
-        }
-    }
+// first 32 bits of the fractional parts of the cube roots of the first 64 primes
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
 
-    /* Step 2: --- parsing the messages  --- */
-    p_m_block = (struct m_block_t *)(void *)&p_new[0];
+/*
+ * process n_blocks of 64 bytes each, updating the intermediate hash H
+ * this is the reference, the accelerated backends below must match it
+ */
+static void sha256_blocks_scalar(uint32_t H[8], const uint8_t *p_blocks, size_t n_blocks) {
+    uint32_t i, t;
+    uint32_t W[64] = {0};
 
-    /* step 3: --- calculate hash --- */
-    N = byte_n / 64;
-    for (i = 0; i < N; i++) {
+    for (i = 0; i < n_blocks; i++) {
         uint32_t a, b, c, d, e, f, g, h;
 
         for (t = 0; t <=15; t++) {
-            /* convert to big edian */
-            W[t] = htobe32(p_m_block->m[t]);
+            uint32_t m;
+
+            /* convert to big edian, the block might not be aligned */
+            memcpy(&m, p_blocks + t * 4, sizeof m);
+            W[t] = htobe32(m);
         }
 
         /* prepare the message schedule W[t] */
@@ -175,65 +137,345 @@ void calc_sha256(uint8_t *p_msg, uint32_t len, uint32_t *p_sha) {
         H[6] = g + H[6];
         H[7] = h + H[7];
 
-        p_m_block++;
+        p_blocks += 64;
     }
+}
 
-    /* the hash is H[0] || H[1]....||H[7] */
-    memcpy(p_sha, &H[0], sizeof(H));
-    return;
+#if SHA256_X86
+/*
+ * Intel SHA extensions, two rounds per sha256rnds2. The state is kept as
+ * ABEF/CDGH as the instructions want it.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t H[8], const uint8_t *p_blocks, size_t n_blocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, tmp;
+    __m128i msg[4];
+    int i = 0;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&H[0]), 0xB1);    /* CDAB */
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&H[4]), 0x1B); /* EFGH */
+    state0 = _mm_alignr_epi8(tmp, state1, 8);                                  /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);                               /* CDGH */
+
+    while (n_blocks-- > 0) {
+        abef = state0;
+        cdgh = state1;
+        for (i = 0; i < 4; i++) {
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p_blocks + i * 16)),
+                    bswap);
+        }
+        /* msg[i & 3] holds W[4i] ~ W[4i + 3] */
+        for (i = 0; i < 16; i++) {
+            tmp = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i *)&K[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, tmp);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(tmp, 0x0E));
+            if (i < 12) {
+                /* W[4i + 16] ~ W[4i + 19] */
+                tmp = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+                tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4));
+                msg[i & 3] = _mm_sha256msg2_epu32(tmp, msg[(i + 3) & 3]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        p_blocks += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);          /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xB1);       /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);    /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);       /* ABEF */
+    _mm_storeu_si128((__m128i *)&H[0], state0);
+    _mm_storeu_si128((__m128i *)&H[4], state1);
+}
+
+#define ROTR_256(x, n)      _mm256_or_si256(_mm256_srli_epi32(x, n), \
+                                _mm256_slli_epi32(x, WIDTH - (n)))
+#define DLT0_256_V(x)       _mm256_xor_si256(_mm256_xor_si256(ROTR_256(x, 7), \
+                                ROTR_256(x, 18)), _mm256_srli_epi32(x, 3))
+#define DLT1_256_V(x)       _mm256_xor_si256(_mm256_xor_si256(ROTR_256(x, 17), \
+                                ROTR_256(x, 19)), _mm256_srli_epi32(x, 10))
+
+/* the 64 rounds of one block, WK[t] is W[t] + K[t] */
+static inline void sha256_rounds(uint32_t H[8], const uint32_t WK[64]) {
+    uint32_t a, b, c, d, e, f, g, h;
+    uint32_t t;
+
+    a = H[0]; b = H[1]; c = H[2]; d = H[3];
+    e = H[4]; f = H[5]; g = H[6]; h = H[7];
+    for (t = 0; t <= 63; t++) {
+        uint32_t T[2];
+
+        T[0] = h + SIG1_256(e) + Ch(e, f, g) + WK[t];
+        T[1] = SIG0_256(a) + Maj(a, b, c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + T[0];
+        d = c;
+        c = b;
+        b = a;
+        a = T[0] + T[1];
+    }
+    H[0] += a; H[1] += b; H[2] += c; H[3] += d;
+    H[4] += e; H[5] += f; H[6] += g; H[7] += h;
 }
 
 /*
- * https://zlib.net/crc_v3.txt
- * for fun:
- * https://stackoverflow.com/questions/2587766/how-is-a-crc32-checksum-calculated
+ * AVX2: the message schedules of two blocks are built side by side, one
+ * block per 128-bit lane and four words at a time, then the rounds run
+ * on the prepared W + K. An odd last block is paired with itself.
  */
-uint32_t calc_crc32(const char *src, uint32_t sz)
-{
-    char ch;
-    uint32_t crc = ~0;
-    uint32_t i = 0;
-    uint32_t j = 0;
-    uint32_t b = 0;
-
-    printf("crc = 0x%x\n", crc);
-    for(i = 0; i < sz; i++) {
-        ch = src[i];
-        for(j = 0; j < 8; j++) {
-            b = (ch ^ crc) & 1;
-            crc >>= 1;
-            if (b) {
-                crc=crc^0xEDB88320;
+__attribute__((target("avx2")))
+static void sha256_blocks_avx2(uint32_t H[8], const uint8_t *p_blocks, size_t n_blocks) {
+    const __m256i bswap = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+            0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    uint32_t WK[2][64] __attribute__((aligned(32)));
+    __m256i X[4], tmp;
+    const uint8_t *p_next = NULL;
+    int i = 0;
+
+    while (n_blocks > 0) {
+        p_next = (n_blocks > 1) ? p_blocks + 64 : p_blocks;
+        for (i = 0; i < 4; i++) {
+            X[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                        _mm_loadu_si128((const __m128i *)(p_blocks + i * 16))),
+                    _mm_loadu_si128((const __m128i *)(p_next + i * 16)), 1);
+            X[i] = _mm256_shuffle_epi8(X[i], bswap);
+        }
+        for (i = 0; i < 16; i++) {
+            /* X[i & 3] holds W[4i] ~ W[4i + 3] of both blocks */
+            tmp = _mm256_add_epi32(X[i & 3], _mm256_broadcastsi128_si256(
+                        _mm_loadu_si128((const __m128i *)&K[i * 4])));
+            _mm_store_si128((__m128i *)&WK[0][i * 4], _mm256_castsi256_si128(tmp));
+            _mm_store_si128((__m128i *)&WK[1][i * 4], _mm256_extracti128_si256(tmp, 1));
+            if (i >= 12) {
+                continue;
             }
-            ch >>= 1;
+            /* W[t - 16] + DLT0(W[t - 15]) + W[t - 7] */
+            tmp = _mm256_add_epi32(X[i & 3],
+                    DLT0_256_V(_mm256_alignr_epi8(X[(i + 1) & 3], X[i & 3], 4)));
+            tmp = _mm256_add_epi32(tmp, _mm256_alignr_epi8(X[(i + 3) & 3], X[(i + 2) & 3], 4));
+            /* DLT1(W[t - 2]), the upper two words depend on the lower two */
+            tmp = _mm256_add_epi32(tmp, DLT1_256_V(_mm256_srli_si256(X[(i + 3) & 3], 8)));
+            tmp = _mm256_add_epi32(tmp, DLT1_256_V(_mm256_slli_si256(tmp, 8)));
+            X[i & 3] = tmp;
+        }
+        sha256_rounds(H, WK[0]);
+        if (n_blocks == 1) {
+            break;
+        }
+        sha256_rounds(H, WK[1]);
+        p_blocks += 128;
+        n_blocks -= 2;
+    }
+}
+
+static bool cpu_has_shani(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(ebx & bit_SHA)) {
+        return false;
+    }
+    /* the SHA extensions come with SSE4.1 in practice, check anyway */
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) != 0;
+}
+
+static bool cpu_has_avx2(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE)) {
+        return false;
+    }
+    /* the OS must save the YMM registers */
+    __asm__ ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    if ((eax & 0x6) != 0x6) {
+        return false;
+    }
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2) != 0;
+}
+#endif /* SHA256_X86 */
+
+static bool cpu_any(void) {
+    return true;
+}
+
+typedef void (*sha256_blocks_fn)(uint32_t H[8], const uint8_t *p_blocks, size_t n_blocks);
+
+/* in the order of preference */
+static const struct {
+    const char *name;
+    sha256_blocks_fn blocks;
+    bool (*supported)(void);
+} sha256_backends[] = {
+#if SHA256_X86
+    {"sha-ni", sha256_blocks_shani, cpu_has_shani},
+    {"avx2", sha256_blocks_avx2, cpu_has_avx2},
+#endif
+    {"scalar", sha256_blocks_scalar, cpu_any},
+};
+
+static sha256_blocks_fn sha256_blocks = sha256_blocks_scalar;
+static const char *sha256_name = "scalar";
+
+/* pick the backend once, before main() */
+__attribute__((constructor))
+static void sha256_select(void) {
+    size_t i = 0;
+
+    for (i = 0; i < sizeof sha256_backends / sizeof sha256_backends[0]; i++) {
+        if (sha256_backends[i].supported()) {
+            sha256_blocks = sha256_backends[i].blocks;
+            sha256_name = sha256_backends[i].name;
+            return;
         }
     }
+}
 
-    printf("crc = %x\n", ~crc);
-    return ~crc;
+const char *sha256_backend(void) {
+    return sha256_name;
 }
+
+void sha256_init(sha256_ctx_t *p_ctx) {
+    // first 32 bits of the fractional parts of the square roots of the first 8 primes
+    static const uint32_t H0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(p_ctx->H, H0, sizeof H0);
+    p_ctx->len = 0;
+    p_ctx->buf_len = 0;
+}
+
+void sha256_update(sha256_ctx_t *p_ctx, const void *p_data, size_t len) {
+    const uint8_t *p_msg = (const uint8_t *)p_data;
+    size_t n = 0;
+
+    p_ctx->len += len;
+    /* top up a partial block left by the previous update */
+    if (p_ctx->buf_len != 0) {
+        n = sizeof p_ctx->buf - p_ctx->buf_len;
+        n = (len < n) ? len : n;
+        memcpy(p_ctx->buf + p_ctx->buf_len, p_msg, n);
+        p_ctx->buf_len += n;
+        p_msg += n;
+        len -= n;
+        if (p_ctx->buf_len < sizeof p_ctx->buf) {
+            return;
+        }
+        sha256_blocks(p_ctx->H, p_ctx->buf, 1);
+        p_ctx->buf_len = 0;
+    }
+    /* whole blocks are hashed in place, no copy */
+    n = len / 64;
+    if (n != 0) {
+        sha256_blocks(p_ctx->H, p_msg, n);
+        p_msg += n * 64;
+        len -= n * 64;
+    }
+    memcpy(p_ctx->buf, p_msg, len);
+    p_ctx->buf_len = len;
+}
+
+/*
+ * padding: msg + 0b1 + 0b0 + .... + (64 bit) of len
+ * the hash H[0] || H[1]....||H[7] is returned in host word order
+ */
+void sha256_final(sha256_ctx_t *p_ctx, uint32_t *p_sha) {
+    uint64_t bits = htobe64(p_ctx->len * 8);
+
+    p_ctx->buf[p_ctx->buf_len++] = 0x80;
+    if (p_ctx->buf_len > sizeof p_ctx->buf - sizeof bits) {
+        /* no room for the length, it goes to one more block */
+        memset(p_ctx->buf + p_ctx->buf_len, 0, sizeof p_ctx->buf - p_ctx->buf_len);
+        sha256_blocks(p_ctx->H, p_ctx->buf, 1);
+        p_ctx->buf_len = 0;
+    }
+    memset(p_ctx->buf + p_ctx->buf_len, 0, sizeof p_ctx->buf - sizeof bits - p_ctx->buf_len);
+    memcpy(p_ctx->buf + sizeof p_ctx->buf - sizeof bits, &bits, sizeof bits);
+    sha256_blocks(p_ctx->H, p_ctx->buf, 1);
+
+    memcpy(p_sha, p_ctx->H, sizeof p_ctx->H);
+}
+
+/* len is in bytes */
+void calc_sha256(const uint8_t *p_msg, uint32_t len, uint32_t *p_sha) {
+    sha256_ctx_t ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, p_msg, len);
+    sha256_final(&ctx, p_sha);
+}
+
 #if TEST_MAIN
 static uint8_t huge_a[1000000];
+
+/* test data are from https://csrc.nist.gov/pubs/fips/180-2/final */
+static const struct {
+    const char *msg;
+    uint32_t repeat;
+    uint32_t sha[8];
+} kat[] = {
+    {"", 1, {0xe3b0c442, 0x98fc1c14, 0x9afbf4c8, 0x996fb924,
+             0x27ae41e4, 0x649b934c, 0xa495991b, 0x7852b855}},
+    {"abc", 1, {0xba7816bf, 0x8f01cfea, 0x414140de, 0x5dae2223,
+                0xb00361a3, 0x96177a9c, 0xb410ff61, 0xf20015ad}},
+    {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+        {0x248d6a61, 0xd20638b8, 0xe5c02693, 0x0c3e6039,
+         0xa33ce459, 0x64ff2167, 0xf6ecedd4, 0x19db06c1}},
+    {"a", 1000000, {0xcdc76e5c, 0x9914fb92, 0x81a1c7e2, 0x84d73e67,
+                    0xf1809a48, 0xa497200e, 0x046d39cc, 0xc7112cd0}},
+};
+
 int main(int argc, char * argv[]) {
     uint32_t sha[8] = {0};
-    uint8_t *p_test = NULL;
-    int i = 0;
+    uint32_t ref[8] = {0};
+    sha256_ctx_t ctx;
+    size_t b = 0;
+    uint32_t i = 0;
+    uint32_t j = 0;
+    int failed = 0;
+    int failed_before = 0;
 
-    /* test data are from https://csrc.nist.gov/pubs/fips/180-2/final */
-    calc_sha256("abc", strlen("abc"), &sha[0]);
-    printf("SHA(\"abc\") = %08x %08x %08x %08x %08x %08x %08x %08x\n",
-            sha[0], sha[1], sha[2], sha[3], sha[4], sha[5], sha[6], sha[7]);
-    calc_sha256("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
-            strlen("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"), &sha[0]);
-    printf("SHA(\"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq\") = %08x %08x %08x %08x %08x %08x %08x %08x\n",
-            sha[0], sha[1], sha[2], sha[3], sha[4], sha[5], sha[6], sha[7]);
-
-    for (i = 0; i < 1000000; i++) {
-        huge_a[i] = 'a';
+    for (i = 0; i < sizeof huge_a; i++) {
+        huge_a[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+    for (b = 0; b < sizeof sha256_backends / sizeof sha256_backends[0]; b++) {
+        if (!sha256_backends[b].supported()) {
+            printf("%-8s skipped\n", sha256_backends[b].name);
+            continue;
+        }
+        sha256_blocks = sha256_backends[b].blocks;
+        failed_before = failed;
+        /* known answers, hashed one piece of the message per update */
+        for (i = 0; i < sizeof kat / sizeof kat[0]; i++) {
+            sha256_init(&ctx);
+            for (j = 0; j < kat[i].repeat; j++) {
+                sha256_update(&ctx, kat[i].msg, strlen(kat[i].msg));
+            }
+            sha256_final(&ctx, sha);
+            if (memcmp(sha, kat[i].sha, sizeof sha) != 0) {
+                printf("%-8s FAIL: \"%.16s\" x %u\n", sha256_backends[b].name,
+                        kat[i].msg, kat[i].repeat);
+                failed++;
+            }
+        }
+        /* every length around the block boundaries against the reference */
+        for (i = 0; i <= 1024 + 64; i++) {
+            sha256_blocks = sha256_blocks_scalar;
+            calc_sha256(huge_a, i, ref);
+            sha256_blocks = sha256_backends[b].blocks;
+            calc_sha256(huge_a, i, sha);
+            if (memcmp(sha, ref, sizeof sha) != 0) {
+                printf("%-8s FAIL: length %u\n", sha256_backends[b].name, i);
+                failed++;
+                break;
+            }
+        }
+        printf("%-8s %s\n", sha256_backends[b].name, failed > failed_before ? "FAIL" : "PASS");
     }
-    calc_sha256(huge_a, 1000000, &sha[0]);
-    printf("SHA(\"a....\") = %08x %08x %08x %08x %08x %08x %08x %08x\n",
-            sha[0], sha[1], sha[2], sha[3], sha[4], sha[5], sha[6], sha[7]);
-    return 0;
+    return failed ? 1 : 0;
 }
 #endif
@@ -0,0 +1,96 @@
+/*
+ * libbl602flash, flash BL 60x boards from a program
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _BL602FLASH_H
+#define _BL602FLASH_H
+
+#include <stdint.h>
+
+#include "flash.h"
+
+/*
+ * A session is one board on one UART device. It holds all there is to
+ * know about the board while it is flashed: the fd, the stage (bootrom
+ * or eflash loader), the timeouts, the packet window, the statistics,
+ * and the pacing, packet sizes and journal of its port. The protocol
+ * functions take the session they work on, nothing of it is global;
+ * sessions share only the read only config.
+ */
+typedef struct bl602_session bl602_session_t;
+
+/*
+ * A loop drives any number of sessions from the thread calling
+ * bl602_loop_run: each session runs until it waits for its UART or for
+ * a deadline, and the loop sleeps in epoll until one of them is there.
+ */
+typedef struct bl602_loop bl602_loop_t;
+
+enum {
+    BL602_LOG_ERROR,
+    BL602_LOG_WARNING,
+    BL602_LOG_INFO,
+    BL602_LOG_DEBUG,
+};
+
+/* p_text is what the tool prints, end of line included */
+typedef void (*bl602_log_cb)(void *p_user, int level, const char *p_text);
+
+/* called as each step starts */
+typedef void (*bl602_step_cb)(void *p_user, flash_state_t state);
+
+typedef struct {
+    uint64_t elapsed_us;
+    uint64_t bytes_saved;           /* by skipped and delta images */
+    uint64_t state_us[FS_DONE];     /* time in each step */
+    uint32_t resends;               /* packets refused or lost, sent again */
+    uint32_t rewrites;              /* flash write errors, erased and written again */
+    const char *p_failed_step;      /* where the session stopped, NULL if it did not fail */
+} bl602_stats_t;
+
+/* NULL if out of memory; p_cfg must outlive the session */
+bl602_session_t *bl602_session_new(const char *p_uart_port, const flash_config_t *p_cfg);
+void bl602_session_free(bl602_session_t *p_ses);
+
+/* without a log callback, errors and warnings go to stderr, the rest to stdout */
+void bl602_session_set_log(bl602_session_t *p_ses, bl602_log_cb log_cb, void *p_user);
+void bl602_session_set_step(bl602_session_t *p_ses, bl602_step_cb step_cb, void *p_user);
+
+/* how long to wait for a response, and for each hand shake attempt, 0 to keep */
+void bl602_session_set_timeouts(bl602_session_t *p_ses, uint32_t resp_ms,
+        uint32_t hand_shake_ms);
+
+/* the whole session, in a loop of its own, 0 on success */
+int bl602_session_run(bl602_session_t *p_ses);
+
+/* NULL if out of memory or out of fds */
+bl602_loop_t *bl602_loop_new(void);
+void bl602_loop_free(bl602_loop_t *p_loop);
+
+/* p_ses is run by the loop, it must outlive the loop */
+int bl602_loop_add(bl602_loop_t *p_loop, bl602_session_t *p_ses);
+
+/* all the sessions added, until each one is done; the number of failed ones */
+int bl602_loop_run(bl602_loop_t *p_loop);
+
+/* of the session once run by a loop, 0 on success */
+int bl602_session_result(const bl602_session_t *p_ses);
+
+void bl602_session_stats(const bl602_session_t *p_ses, bl602_stats_t *p_stats);
+
+#endif /* _BL602FLASH_H */
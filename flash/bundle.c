@@ -0,0 +1,142 @@
+/*
+ * bundle of the eflash loader and the images, ready to flash
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "bundle.h"
+#include "session.h"
+
+static uint32_t align_up(uint32_t offset) {
+    return (offset + BUNDLE_ALIGN - 1) & ~(uint32_t)(BUNDLE_ALIGN - 1);
+}
+
+int bundle_write(const char *p_path, const bundle_item_t *p_items, uint32_t n_items) {
+    int ret_code = 0;
+    bundle_header_t header;
+    bundle_entry_t entries[BUNDLE_ENTRIES_MAX];
+    uint32_t offset = 0;
+    uint32_t i = 0;
+    FILE *f = NULL;
+
+    if (n_items > BUNDLE_ENTRIES_MAX) {
+        return -1;
+    }
+    memset(&header, 0, sizeof header);
+    memset(entries, 0, sizeof entries);
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof header.magic);
+    header.version = BUNDLE_VERSION;
+    header.n_entries = n_items;
+    offset = align_up(sizeof header + n_items * sizeof entries[0]);
+    for (i = 0; i < n_items; i++) {
+        entries[i].type = p_items[i].type;
+        entries[i].dst = p_items[i].dst;
+        entries[i].offset = offset;
+        entries[i].size = p_items[i].p_image->size;
+        memcpy(entries[i].sha256, p_items[i].p_sha256, sizeof entries[i].sha256);
+        snprintf(entries[i].name, sizeof entries[i].name, "%s", p_items[i].p_name);
+        offset = align_up(offset + entries[i].size);
+    }
+    header.crc32 = calc_crc32((const char *)entries, n_items * sizeof entries[0]);
+
+    f = fopen(p_path, "w");
+    if (f == NULL) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: fail to open %s\n", p_path);
+        return -2;
+    }
+    if (fwrite(&header, sizeof header, 1, f) != 1
+            || fwrite(entries, sizeof entries[0], n_items, f) != n_items) {
+        ret_code = -3;
+        goto fail;
+    }
+    for (i = 0; i < n_items; i++) {
+        if (fseek(f, entries[i].offset, SEEK_SET) != 0
+                || fwrite(p_items[i].p_image->p_data, 1, entries[i].size, f)
+                != entries[i].size) {
+            ret_code = -3;
+            goto fail;
+        }
+    }
+
+fail:
+    if (fclose(f) != 0 && ret_code == 0) {
+        ret_code = -3;
+    }
+    if (ret_code != 0) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: fail to write %s\n", p_path);
+    }
+    return ret_code;
+}
+
+int bundle_open(const char *p_path, image_view_t *p_bundle,
+        const bundle_entry_t **pp_entries, uint32_t *p_n_entries) {
+    const bundle_header_t *p_header = NULL;
+    const bundle_entry_t *p_entries = NULL;
+    uint32_t i = 0;
+    int ret_code = 0;
+
+    ret_code = image_open(p_path, p_bundle);
+    if (ret_code != 0) {
+        return ret_code;
+    }
+    p_header = (const bundle_header_t *)p_bundle->p_data;
+    p_entries = (const bundle_entry_t *)(p_header + 1);
+    if (p_bundle->size < sizeof(*p_header)
+            || memcmp(p_header->magic, BUNDLE_MAGIC, sizeof p_header->magic) != 0
+            || p_header->version != BUNDLE_VERSION
+            || p_header->n_entries > BUNDLE_ENTRIES_MAX
+            || p_bundle->size < sizeof(*p_header) + p_header->n_entries * sizeof(*p_entries)) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: %s is not a bundle\n", p_path);
+        ret_code = -5;
+        goto fail;
+    }
+    if (p_header->crc32 != calc_crc32((const char *)p_entries,
+                p_header->n_entries * sizeof(*p_entries))) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: CRC32 of the bundle manifest mismatch\n");
+        ret_code = -6;
+        goto fail;
+    }
+    for (i = 0; i < p_header->n_entries; i++) {
+        if (p_entries[i].offset > p_bundle->size
+                || p_entries[i].size > p_bundle->size - p_entries[i].offset) {
+            flash_log(NULL, BL602_LOG_ERROR, "ERROR: %s is cut short\n", p_path);
+            ret_code = -7;
+            goto fail;
+        }
+    }
+    *pp_entries = p_entries;
+    *p_n_entries = p_header->n_entries;
+
+    return 0;
+
+fail:
+    image_close(p_bundle);
+    return ret_code;
+}
+
+void bundle_view(const image_view_t *p_bundle, const bundle_entry_t *p_entry,
+        image_view_t *p_view) {
+    p_view->p_data = p_bundle->p_data + p_entry->offset;
+    p_view->size = p_entry->size;
+    p_view->mapped = false;
+}
@@ -0,0 +1,79 @@
+/*
+ * bundle of the eflash loader and the images, ready to flash
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _BUNDLE_H
+#define _BUNDLE_H
+
+#include <stdint.h>
+
+#include "image.h"
+
+/*
+ * A bundle is a header, the manifest (one entry per file) and the files,
+ * each one at a 4K boundary. The manifest carries what is otherwise
+ * worked out at each run: where the images go and their SHA256. The
+ * bundle is mapped, the loader and the images are views into it.
+ */
+#define BUNDLE_MAGIC        "BL60XBDL"
+#define BUNDLE_VERSION      1
+#define BUNDLE_ALIGN        4096
+#define BUNDLE_ENTRIES_MAX  8
+
+enum {
+    BUNDLE_LOADER,
+    BUNDLE_IMAGE,
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    uint32_t crc32;                 /* of the manifest */
+    uint32_t rsvd;
+} bundle_header_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t dst;
+    uint32_t offset;                /* of the file in the bundle */
+    uint32_t size;
+    uint32_t sha256[8];
+    char name[64];
+} bundle_entry_t;
+
+/* what goes into a bundle */
+typedef struct {
+    uint32_t type;
+    uint32_t dst;
+    const image_view_t *p_image;
+    const uint32_t *p_sha256;
+    const char *p_name;
+} bundle_item_t;
+
+int bundle_write(const char *p_path, const bundle_item_t *p_items, uint32_t n_items);
+
+/* map the bundle and check its manifest, *pp_entries points into it */
+int bundle_open(const char *p_path, image_view_t *p_bundle,
+        const bundle_entry_t **pp_entries, uint32_t *p_n_entries);
+
+/* the file of an entry, a view into the bundle not to be closed */
+void bundle_view(const image_view_t *p_bundle, const bundle_entry_t *p_entry,
+        image_view_t *p_view);
+
+#endif /* _BUNDLE_H */
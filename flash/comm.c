@@ -25,12 +25,38 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <termios.h>
 #include <string.h>
-#include <assert.h>
+#include <sys/uio.h>
+#include <poll.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "packet_comm.h"
 #include "err_code.h"
 #include "common_share.h"
+#include "uart.h"
+#include "pacing.h"
+#include "image.h"
+#include "comm.h"
+#include "pipeline.h"
+#include "plan.h"
+#include "pktsize.h"
+#include "journal.h"
+#include "session.h"
+
+/* deadlines in mili-seconds, the response and hand shake ones are set per session */
+#define WRITE_TIMEOUT_MS            10000
+/* worst case of erasing one 4K sector */
+#define ERASE_TIMEOUT_PER_4K_MS     400
+#define HAND_SHAKE_RETRY            5
+/* tries of a packet after the first one, without progress in between */
+#define PKT_RETRY_MAX               3
+/* send_window: the flash failed to take a packet, erase and write again */
+#define FLASH_REWRITE               -5
+/* a wait for the producer of a pipeline, it signals well before */
+#define PIPE_WAIT_MS                100
 
 #define ADD_ERROR(id) {id, #id}
 struct {
@@ -156,15 +182,15 @@ void dump_hex(const char *prefix, uint8_t *p_data, uint32_t len) {
     uint32_t i = 0;
 
     if (prefix != NULL) {
-        fprintf(stdout, "%s dump:", prefix);
+        flash_log(NULL, BL602_LOG_INFO, "%s dump:", prefix);
     }
     for (i = 0; i < len; i++) {
         if ((i % 8) == 0) {
-            fprintf(stdout, "\n");
+            flash_log(NULL, BL602_LOG_INFO, "\n");
         }
-        fprintf(stdout, "0x%02x ", p_data[i]);
+        flash_log(NULL, BL602_LOG_INFO, "0x%02x ", p_data[i]);
     }
-    fprintf(stdout, "\n\n");
+    flash_log(NULL, BL602_LOG_INFO, "\n\n");
 }
 
 static bool is_ok(uint8_t *result) {
@@ -184,10 +210,10 @@ static void init_header(COMMAND_ID id, uint32_t len, packet_hdr_t *p_hdr) {
     }
 }
 
-static const char * lookup_error(uint16_t err_code) {
+static const char * lookup_error(const bl602_session_t *p_ses, uint16_t err_code) {
     uint16_t i = 0;
 
-    if (boot_rom_stage) {
+    if (p_ses->boot_rom_stage) {
         for (i = 0; i < ARRAY_SIZE(bootrom_error_table); i++) {
             if ((bootrom_error_code_t)err_code == bootrom_error_table[i].err_code) {
                 return bootrom_error_table[i].err_str;
@@ -204,191 +230,307 @@ static const char * lookup_error(uint16_t err_code) {
     return "Unknown error code\n";
 }
 
-static int read_check_response(int uart_fd, bl_resp_t *p_resp) {
+static bool is_pending(uint8_t *result) {
+    return (result[0] == 'P' && result[1] == 'D');
+}
+
+/*
+ * commands which are answered with 'O''K' + len + payload,
+ * all others are answered with 'O''K' only.
+ */
+static bool has_payload(COMMAND_ID cmd_id) {
+    return (cmd_id == COMMAND_BOOT_INFO || cmd_id == COMMAND_SEG_HDR
+            || cmd_id == COMMAND_SHA_256 || cmd_id == COMMAND_READ_JID);
+}
+
+/*
+ * The response comes in as a byte stream, and it might be split
+ * into several reads:
+ *      'O''K'                          ack
+ *      'O''K' len_lsb len_msb payload  ack with payload
+ *      'F''L' err_lsb err_msb          failure with error code
+ *      'P''D'                          pending, device is still busy
+ * Return the number of bytes missing to complete the frame in p_buf,
+ * or negative value if the frame is malformed.
+ */
+static int resp_bytes_missing(uint8_t *p_buf, uint32_t got, bool payload) {
+    uint32_t len = 0;
+
+    if (got < 2) {
+        return 2 - got;
+    }
+    if (is_ok(p_buf)) {
+        if (!payload) {
+            return 0;
+        }
+        if (got < 4) {
+            return 4 - got;
+        }
+        len = 4 + (p_buf[3] << 8 | p_buf[2]);
+        if (len > sizeof(bl_resp_t)) {
+            return -1;
+        }
+        return len - got;
+    }
+    if (is_fail(p_buf)) {
+        return (got < 4) ? 4 - got : 0;
+    }
+
+    return -1;
+}
+
+/*
+ * the additive checksum (sum of bytes modulo 256) used in the
+ * rsvd_08 field of eflash loader commands
+ */
+static uint8_t checksum8(const uint8_t *p_data, uint32_t len) {
+    uint32_t sum = 0;
+#if defined(__SSE2__)
+    /* psadbw sums 8 bytes at a time into each 64-bit lane */
+    __m128i acc = _mm_setzero_si128();
+    const __m128i zero = _mm_setzero_si128();
+
+    while (len >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p_data);
+
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+        p_data += 16;
+        len -= 16;
+    }
+    sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#else
+    /* add the even and odd bytes of 8 bytes into four 16-bit lanes */
+    const uint64_t mask = 0x00FF00FF00FF00FFULL;
+
+    while (len >= 8) {
+        /* at most 128 words before a 16-bit lane may overflow */
+        uint32_t words = (len / 8 > 128) ? 128 : len / 8;
+        uint64_t acc = 0;
+        uint64_t w = 0;
+
+        len -= words * 8;
+        while (words-- > 0) {
+            memcpy(&w, p_data, sizeof w);
+            acc += (w & mask) + ((w >> 8) & mask);
+            p_data += 8;
+        }
+        acc = (acc & 0x0000FFFF0000FFFFULL) + ((acc >> 16) & 0x0000FFFF0000FFFFULL);
+        sum += (uint32_t)acc + (uint32_t)(acc >> 32);
+    }
+#endif
+    while (len-- > 0) {
+        sum += *p_data++;
+    }
+
+    return sum & 0xFF;
+}
+
+static int send_packet_v(bl602_session_t *p_ses, struct iovec *iov, int iov_cnt) {
+    /* the first byte is the command id, or 0x55 of hand shake */
+    uint8_t cmd_id = *(const uint8_t *)iov[0].iov_base;
+
+    session_sleep_until(p_ses, pace_before_send(&p_ses->pace, cmd_id));
+    /* stray bytes would be taken as the response of this packet */
+    (void) uart_drain_input(p_ses->uart_fd);
+    if (uart_writev_all(p_ses, iov, iov_cnt, WRITE_TIMEOUT_MS) != 0) {
+        return -1;
+    }
+    /* the response can not come before the last byte is sent out */
+    if (uart_wait_sent(p_ses, WRITE_TIMEOUT_MS) != 0) {
+        return -1;
+    }
+    pace_after_send(&p_ses->pace);
+
+    return 0;
+}
+
+static int send_packet(bl602_session_t *p_ses, const void *p_pkt, uint32_t len) {
+    struct iovec iov = {(void *)p_pkt, len};
+
+    return send_packet_v(p_ses, &iov, 1);
+}
+
+static int read_check_response(bl602_session_t *p_ses, COMMAND_ID cmd_id, bl_resp_t *p_resp,
+        uint32_t timeout_ms) {
     int ret_code = 0;
-    int bytes_n = 0;
+    int missing = 0;
+    uint32_t got = 0;
+    uint64_t deadline = mono_time_us() + (uint64_t)timeout_ms * 1000;
     bl_resp_t resp;
 
-    /* wait for 100 miliseconds */
-    usleep(100 * 1000);
-
     memset(&resp, 0, sizeof resp);
-loop:
-    bytes_n = read(uart_fd, (void *)&resp, sizeof resp);
-    if (bytes_n < 0) {
-        ret_code = -2;
-        fprintf(stderr, "ERROR: fail to read response [bytes_n = %d]\n", bytes_n);
-        goto fail;
-    }
-    if (bytes_n == 0) {
-        printf("wait and try\n");
-        usleep(20 * 1000);
-        goto loop;
+    /* read exactly what the frame needs, the rest belongs to the next one */
+    while ((missing = resp_bytes_missing((uint8_t *)&resp, got,
+                    has_payload(cmd_id))) > 0) {
+        uint64_t now = mono_time_us();
+        ssize_t bytes_n = 0;
+
+        if (now >= deadline) {
+            ret_code = -2;
+            flash_log(p_ses, BL602_LOG_ERROR,
+                    "ERROR: timeout in reading response [%u bytes]\n", got);
+            goto fail;
+        }
+        bytes_n = uart_read_timeout(p_ses, (uint8_t *)&resp + got, missing,
+                (deadline - now + 999) / 1000);
+        if (bytes_n < 0) {
+            ret_code = -2;
+            flash_log(p_ses, BL602_LOG_ERROR,
+                    "ERROR: fail to read response [bytes_n = %zd]\n", bytes_n);
+            goto fail;
+        }
+        got += bytes_n;
+        if (got == 2 && is_pending(resp.result)) {
+            /* device is busy, keep waiting for the real response */
+            got = 0;
+        }
     }
 
-    printf("received [%d] bytes: %c%c\n", bytes_n,
+    flash_log(p_ses, BL602_LOG_INFO, "received [%u] bytes: %c%c\n", got,
             resp.result[0], resp.result[1]);
 #ifdef DEBUG
-    dump_hex(__FUNCTION__, (uint8_t *)&resp, bytes_n);
+    dump_hex(__FUNCTION__, (uint8_t *)&resp, got);
 #endif
 
-    if (is_ok(resp.result)) {
+    if (missing == 0 && is_ok(resp.result)) {
         ret_code = 0;
-    } else if (is_fail(resp.result)) {
+    } else if (missing == 0 && is_fail(resp.result)) {
         uint16_t err_code = (resp.err_msb << 8 | resp.err_lsb);
         /* fail, print out the error code */
-        fprintf(stderr, "ERROR: error code = [0x%04x] %s\n\n", err_code,
-                lookup_error(err_code));
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: error code = [0x%04x] %s\n\n", err_code,
+                lookup_error(p_ses, err_code));
         ret_code = -3;
         goto fail;
     } else {
-        fprintf(stderr, "ERROR: unknown response\n\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: unknown response\n\n");
         ret_code = -4;
         goto fail;
     }
 
+fail:
+    /* FL responses are copied too, the caller may act on the error code */
     if (p_resp != NULL) {
         memcpy(p_resp, &resp, sizeof(*p_resp));
     }
-fail:
-    return ret_code;
-}
-
-/*
- * read file into a allocated buffer
- */
-int read_to_buf(char *p_file_name, uint8_t **p_buf, uint32_t *p_sz_data) {
-    int ret_code = 0;
-    struct stat f_stat;
-    uint8_t *p_local = NULL;
-    ssize_t items_n = 0;
-    FILE *f = NULL;
-
-    if (p_file_name == NULL) {
-        return -1;
-    }
-    ret_code = stat(p_file_name, &f_stat);
-    if (ret_code < 0) {
-        fprintf(stderr, "ERROR: fail to get stats of '%s'", p_file_name);
-        return -2;
-    }
-    p_local = (uint8_t *)malloc(f_stat.st_size);
-    if (p_local == NULL) {
-        fprintf(stderr, "ERROR: malloc fail for '%s'", p_file_name);
-        return -3;
-    }
-    memset(p_local, 0, f_stat.st_size);
-
-    f = fopen(p_file_name, "r");
-    if (f == NULL) {
-        fprintf(stderr, "ERROR: fail to open %s\n", p_file_name);
-        return -4;
-    }
-    /* fread should return 1, skip check ret value intentionally below */
-    items_n = fread((void *)p_local, f_stat.st_size, 1, f);
-    if (items_n != 1) {
-        fprintf(stderr, "ERROR: incorrect items read\n");
-        ret_code = -5;
-        goto fail;
-    }
-
-    *p_buf = p_local;
-    *p_sz_data = f_stat.st_size;
-
-fail:
-    fclose(f);
+    /*
+     * lost or garbled command means the device was not ready for it,
+     * other failures are the result of the command itself.
+     */
+    pace_after_response(&p_ses->pace, cmd_id, ret_code == -2 || ret_code == -4
+            || (ret_code == -3 && resp.err_msb == 0x01));
     return ret_code;
 }
 
 /*
  * UART hand shake between the host and the target
  */
-int hand_shake(int uart_fd, uint32_t baud_rate)
+int hand_shake(bl602_session_t *p_ses, uint32_t baud_rate)
 {
     int ret_status = 0;
     uint8_t *p_stream_hfive;
+    uint8_t read_buf[2];
     ssize_t bytes_n;
-    ssize_t write_n;
+    uint32_t got;
+    int retry;
 
-    fprintf(stdout, "hand shake with rate %u\n", baud_rate);
+    flash_log(p_ses, BL602_LOG_INFO, "hand shake with rate %u\n", baud_rate);
     /*
      * approximate the number of bytes of 0x55 to send in 5 mseconds
      * using the current baud rate with 8N1
      */
     bytes_n = 7 * baud_rate / 10000;
 #ifdef DEBUG
-    printf("shake hands bytes_n = %ld\n", bytes_n);
+    flash_log(p_ses, BL602_LOG_DEBUG, "shake hands bytes_n = %ld\n", bytes_n);
 #endif
     p_stream_hfive = (uint8_t *) malloc(bytes_n);
-    memset(p_stream_hfive, 0x55, bytes_n);
-    write_n = write(uart_fd, (void *)p_stream_hfive, bytes_n);
-    free(p_stream_hfive);
-    if (write_n != bytes_n) {
-        ret_status = -1;
-        fprintf(stderr, "ERROR: incorrect bytes written (%lu vs %lu)\n",
-                write_n, bytes_n);
-        goto fail;
+    if (p_stream_hfive == NULL) {
+        return -1;
     }
+    memset(p_stream_hfive, 0x55, bytes_n);
 
-    /* now read from the device */
-    while (1) {
-        char read_buf[256] = {0};
-
-        usleep(100 * 1000); // Sleep for 100ms
-        memset(read_buf, 0, sizeof(read_buf));
-        bytes_n = read(uart_fd, read_buf, sizeof(read_buf));
-        if (bytes_n > 0) {
-            printf("Received (%lu bytes): %c%c\n", bytes_n, read_buf[0], read_buf[1]);
-            /* check the result: "OK", "FL" */
-            if (read_buf[0] == 'O' && read_buf[1] == 'K') {
-                printf("SUCCEED: hand shake\n\n");
-                break;
-            }
-            else if (read_buf[0] == 'F' && read_buf[1] == 'L') {
-                fprintf(stderr, "ERROR: fail in hand shake\n\n");
-                ret_status = -2;
+    for (retry = 0; retry < HAND_SHAKE_RETRY; retry++) {
+        uint64_t deadline;
+
+        if (send_packet(p_ses, p_stream_hfive, bytes_n) != 0) {
+            ret_status = -1;
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: incorrect bytes written (%lu)\n", bytes_n);
+            goto fail;
+        }
+
+        /* now read from the device, return as soon as "OK"/"FL" is here */
+        deadline = mono_time_us() + p_ses->hand_shake_timeout_ms * 1000;
+        got = 0;
+        while (got < sizeof read_buf) {
+            uint64_t now = mono_time_us();
+            ssize_t read_n;
+
+            if (now >= deadline) {
                 break;
             }
-            else {
-                fprintf(stderr, "ERROR: unknown response\n\n");
-                ret_status = -3;
-                break;
+            read_n = uart_read_timeout(p_ses, read_buf + got,
+                    sizeof read_buf - got, (deadline - now + 999) / 1000);
+            if (read_n < 0) {
+                ret_status = -1;
+                flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fail to read hand shake response\n");
+                goto fail;
             }
-        } /* bytes_n */
+            got += read_n;
+        }
+        pace_after_response(&p_ses->pace, p_stream_hfive[0], got < sizeof read_buf);
+        if (got < sizeof read_buf) {
+            /* nothing back in time, shake again */
+            continue;
+        }
+
+        flash_log(p_ses, BL602_LOG_INFO,
+                "Received (%u bytes): %c%c\n", got, read_buf[0], read_buf[1]);
+        /* check the result: "OK", "FL" */
+        if (is_ok(read_buf)) {
+            flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: hand shake\n\n");
+            ret_status = 0;
+        } else if (is_fail(read_buf)) {
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fail in hand shake\n\n");
+            ret_status = -2;
+        } else {
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: unknown response\n\n");
+            ret_status = -3;
+        }
+        goto fail;
     }
 
+    flash_log(p_ses, BL602_LOG_ERROR, "ERROR: no response in hand shake\n\n");
+    ret_status = -4;
+
 fail:
+    free(p_stream_hfive);
     return ret_status; /* zero is OK */
 }
 
-int request_boot_info(int uart_fd, boot_info_t *p_boot_info) {
+int request_boot_info(bl602_session_t *p_ses, boot_info_t *p_boot_info) {
     int ret_code = 0;
-    int bytes_n = 0;
     boot_info_req_t req;
     bl_resp_t resp;
 
     memset(&req, 0, sizeof req);
     init_header(COMMAND_BOOT_INFO, 0, &req.bi_hdr);
 
-    usleep(100 * 1000);
-    bytes_n = write(uart_fd, (void *)&req, sizeof req);
-    if (bytes_n < sizeof req) {
+    if (send_packet(p_ses, &req, sizeof req) != 0) {
         ret_code = -1;
-        fprintf(stderr, "ERROR: fail to send request boot_info\n\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fail to send request boot_info\n\n");
         goto fail;
     }
 
-    ret_code = read_check_response(uart_fd, &resp);
+    ret_code = read_check_response(p_ses, COMMAND_BOOT_INFO, &resp, p_ses->resp_timeout_ms);
     if (ret_code == 0) {
         /* sanity check the length field */
         uint32_t len = (resp.len_msb << 8) | (resp.len_lsb);
 
         if (len != sizeof(boot_info_t)) {
-            fprintf(stderr, "ERROR: inavlid payload\n\n");
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: inavlid payload\n\n");
             ret_code = -2;
             goto fail;
         }
-        fprintf(stdout, "boot_rom_ver: 0x%x\n", resp.boot_info.boot_rom_ver);
+        flash_log(p_ses, BL602_LOG_INFO, "boot_rom_ver: 0x%x\n", resp.boot_info.boot_rom_ver);
         dump_hex("opt_info", (uint8_t *)&resp.boot_info.opt_info[0],
                 sizeof(resp.boot_info.opt_info));
 
@@ -399,9 +541,9 @@ int request_boot_info(int uart_fd, boot_info_t *p_boot_info) {
 
 fail:
     if (ret_code == 0) {
-        fprintf(stdout, "SUCCEED: get boot_info\n\n");
+        flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: get boot_info\n\n");
     } else {
-        fprintf(stderr, "ERROR: fail to get boot_info\n\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fail to get boot_info\n\n");
     }
     return ret_code;
 }
@@ -412,235 +554,355 @@ fail:
  *      segment_header_t   (16 bytes)
  *      eflash executable
  */
-int load_boot_header(int uart_fd, char *eflash_file_name)
+int load_boot_header(bl602_session_t *p_ses, const image_view_t *p_eflash)
 {
     int ret_code = 0;
-    FILE *f = NULL;
     boot_header_pkt_t boot_header_pkt;
-    ssize_t bytes_n = 0;
 
-    if (eflash_file_name == NULL) {
+    if (p_eflash == NULL || p_eflash->size < sizeof boot_header_pkt.boot_header) {
         return -1;
     }
-    f = fopen(eflash_file_name, "r");
-    if (f == NULL) {
-        return -2;
-    }
     /* construct the packet to device and send */
     init_header(COMMAND_BOOT_HDR, sizeof boot_header_pkt.boot_header,
             &boot_header_pkt.bh_hdr);
-    bytes_n = fread(&boot_header_pkt.boot_header, sizeof boot_header_pkt.boot_header,
-            1, f);
-    fclose(f);
-    if (bytes_n != 1) {
-        ret_code = -3;
-        fprintf(stderr, "ERROR: incorrect items read\n");
-        goto fail;
-    }
-    bytes_n = write(uart_fd, (void *)&boot_header_pkt, sizeof boot_header_pkt);
-    if (bytes_n != sizeof boot_header_pkt) {
+    memcpy(&boot_header_pkt.boot_header, p_eflash->p_data,
+            sizeof boot_header_pkt.boot_header);
+    if (send_packet(p_ses, &boot_header_pkt, sizeof boot_header_pkt) != 0) {
         ret_code = 1;
-        fprintf(stderr, "ERROR: fewer bytes written\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fewer bytes written\n");
         goto fail;
     }
 
-    ret_code = read_check_response(uart_fd, NULL);
+    ret_code = read_check_response(p_ses, COMMAND_BOOT_HDR, NULL, p_ses->resp_timeout_ms);
     if (ret_code == 0) {
-        fprintf(stdout, "SUCCEED: load boot header\n\n");
+        flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: load boot header\n\n");
     } else {
-        fprintf(stderr, "ERROR: failed in loading boot header\n\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: failed in loading boot header\n\n");
     }
 
 fail:
     return ret_code;
 }
 
-int load_segment_header(int uart_fd, char *eflash_file_name) {
+int load_segment_header(bl602_session_t *p_ses, const image_view_t *p_eflash) {
     int ret_code = 0;
-    ssize_t bytes_n = 0;
-    FILE *f = NULL;
     segment_header_pkt_t segment_header_pkt;
 
-    if (eflash_file_name == NULL) {
+    if (p_eflash == NULL || p_eflash->size < sizeof(Boot_Header_Config)
+            + sizeof segment_header_pkt.segment) {
         return -1;
     }
-    f = fopen(eflash_file_name, "r");
-    if (f == NULL) {
-        fprintf(stderr, "ERROR: unable to open file [%s]\n\n", eflash_file_name);
-        return -2;
-    }
     /* construct the packet to device and send */
     memset(&segment_header_pkt, 0, sizeof segment_header_pkt);
 
     init_header(COMMAND_SEG_HDR, sizeof segment_header_pkt.segment,
             &segment_header_pkt.seg_hdr);
     /* skip the section of Boot_Header_Config */
-    fseek(f, sizeof(Boot_Header_Config), SEEK_SET);
-    bytes_n = fread(&segment_header_pkt.segment, sizeof segment_header_pkt.segment,
-            1, f);
-    fclose(f);
-    if (bytes_n != 1) {
-        fprintf(stderr, "ERROR: incorrect number of items read\n");
-        ret_code = -3;
-        goto fail;
-    }
+    memcpy(&segment_header_pkt.segment, p_eflash->p_data + sizeof(Boot_Header_Config),
+            sizeof segment_header_pkt.segment);
 #ifdef DEBUG
     dump_hex("segment header", (uint8_t *)&segment_header_pkt, sizeof segment_header_pkt);
-    printf("dest_addr = 0x%x len = %u, rsvd = 0x%x crc32 = 0x%x\n",
+    flash_log(p_ses, BL602_LOG_DEBUG, "dest_addr = 0x%x len = %u, rsvd = 0x%x crc32 = 0x%x\n",
             segment_header_pkt.segment.dest_addr,
             segment_header_pkt.segment.len,
             segment_header_pkt.segment.rsvd,
             segment_header_pkt.segment.crc32);
 #endif
-    bytes_n = write(uart_fd, (void *)&segment_header_pkt, sizeof segment_header_pkt);
-    if (bytes_n != sizeof segment_header_pkt) {
+    if (send_packet(p_ses, &segment_header_pkt, sizeof segment_header_pkt) != 0) {
         ret_code = -1;
-        fprintf(stderr, "ERROR: incorrect number of bytes written\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: incorrect number of bytes written\n");
         goto fail;
     }
 
     /* check response */
-    ret_code = read_check_response(uart_fd, NULL);
+    ret_code = read_check_response(p_ses, COMMAND_SEG_HDR, NULL, p_ses->resp_timeout_ms);
     if (ret_code == 0) {
-        fprintf(stdout, "SUCCEED: load segment header\n\n");
+        flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: load segment header\n\n");
     } else {
-        fprintf(stderr, "ERROR: fail to load segement header\n\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fail to load segement header\n\n");
     }
 
 fail:
     return ret_code;
 }
 
-int load_segment_data(int uart_fd, char *eflash_file_name) {
-    int ret_code = 0;
-    ssize_t bytes_n = 0;
-    FILE *f = NULL;
-    segment_data_pkt_t segment_data_pkt;
-    int i = 0;
-    int real_len;
-    int remain = 0;
-    int skip_len = sizeof(Boot_Header_Config) + sizeof(segment_header_t);
-    struct stat f_stat;
-
-    if (eflash_file_name == NULL) {
-        return -1;
+/*
+ * the next frame to send, NULL past the last one. While the producer is
+ * behind, the session waits in its loop on the event of the pipeline,
+ * so the other ports go on.
+ */
+static pipe_frame_t *next_frame(bl602_session_t *p_ses, pipeline_t *p_pipe, uint32_t idx) {
+    while (!pipeline_ready(p_pipe, idx)) {
+        if (pipeline_arm(p_pipe, idx)) {
+            (void) session_wait_fd(p_ses, p_pipe->event_fd, POLLIN,
+                    mono_time_us() + PIPE_WAIT_MS * 1000);
+        }
     }
 
-    assert(sizeof(segment_data_pkt) <= 4096);
-    ret_code = stat(eflash_file_name, &f_stat);
-    if (ret_code < 0) {
-        fprintf(stderr, "ERROR: fail to get file statistics [%s]\n\n", eflash_file_name);
-        return ret_code;
+    return pipeline_peek(p_pipe, idx);
+}
+
+/*
+ * With queued set, the packet follows others whose acks are still to
+ * come, so the input is left alone and the pacing is skipped.
+ */
+static int send_frame(bl602_session_t *p_ses, const pipe_frame_t *p_frame, bool queued) {
+    struct iovec iov[2] = {
+        {(void *)p_frame->hdr, p_frame->hdr_len},
+        {(void *)p_frame->p_data, p_frame->data_len},
+    };
+
+    if (queued) {
+        return uart_writev_all(p_ses, iov, 2, WRITE_TIMEOUT_MS);
+    }
+    return send_packet_v(p_ses, iov, 2);
+}
+
+static void build_segment_data(pipe_frame_t *p_frame, const uint8_t *p_data,
+        uint32_t data_len, uint32_t addr) {
+    init_header(COMMAND_SEG_DATA, data_len, (packet_hdr_t *)p_frame->hdr);
+    p_frame->hdr_len = sizeof(packet_hdr_t);
+    p_frame->p_data = p_data;
+    p_frame->data_len = data_len;
+    p_frame->addr = addr;
+}
+
+/*
+ * wait until the device has nothing more to say, whatever it sends
+ * in the meantime is discarded
+ */
+static void wait_line_quiet(bl602_session_t *p_ses, uint32_t quiet_ms) {
+    uint8_t scratch[64];
+
+    (void) uart_wait_sent(p_ses, WRITE_TIMEOUT_MS);
+    while (uart_read_timeout(p_ses, scratch, sizeof scratch, quiet_ms) > 0) {
+    }
+}
+
+/* what a failed command calls for */
+typedef enum {
+    ERR_REJECTED,       /* the packet was refused as received: send it again */
+    ERR_LOST,           /* no or a garbled answer, the packet may have been taken */
+    ERR_WRITE,          /* the flash did not take the data: erase it again */
+    ERR_FATAL,
+} err_class_t;
+
+/* the bootrom and the loader share the codes of these errors */
+static err_class_t error_class(int ret_code, const bl_resp_t *p_resp) {
+    uint16_t err_code = (p_resp->err_msb << 8 | p_resp->err_lsb);
+
+    if (ret_code == -2 || ret_code == -4) {
+        return ERR_LOST;
+    }
+    if (ret_code != -3) {
+        return ERR_FATAL;
+    }
+    switch (err_code) {
+    case BFLB_EFLASH_LOADER_CMD_LEN_ERROR:
+    case BFLB_EFLASH_LOADER_CMD_CRC_ERROR:
+    case BFLB_EFLASH_LOADER_CMD_SEQ_ERROR:
+        return ERR_REJECTED;
+    case BFLB_EFLASH_LOADER_FLASH_WRITE_ERROR:
+        return ERR_WRITE;
+    default:
+        return ERR_FATAL;
+    }
+}
+
+/*
+ * Send the first packet of p_data with the largest payload accepted,
+ * from max_payload down, halving on each refusal. *p_sent is the number
+ * of bytes taken; the size is known once a full packet is acked.
+ */
+static int probe_payload(bl602_session_t *p_ses, COMMAND_ID cmd_id, pipe_build_fn build,
+        const uint8_t *p_data, uint32_t len, uint32_t addr, uint32_t max_payload,
+        uint32_t *p_payload, bool *p_known, uint32_t *p_sent) {
+    int ret_code = -1;
+    pipe_frame_t frame;
+    pipe_frame_t *p_frame = &frame;
+    uint32_t size = 0;
+    uint32_t data_len = 0;
+
+    for (size = max_payload; size >= PKT_PAYLOAD_MIN; size /= 2) {
+        data_len = (len > size) ? size : len;
+        build(p_frame, p_data, data_len, addr);
+        if (send_frame(p_ses, p_frame, false) != 0) {
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: incorrect number of bytes written\n");
+            ret_code = -1;
+            break;
+        }
+        ret_code = read_check_response(p_ses, cmd_id, NULL, p_ses->resp_timeout_ms);
+        if (ret_code == 0) {
+            if (data_len == size) {
+                pktsize_found(&p_ses->pkt, p_payload, p_known, size);
+                flash_log(p_ses, BL602_LOG_INFO, "packets of (%u) bytes payload accepted\n", size);
+            }
+            *p_sent = data_len;
+            break;
+        }
+        if (data_len < size) {
+            /* not refused for its size */
+            break;
+        }
+        flash_log(p_ses, BL602_LOG_WARNING,
+                "WARNING: packet of (%u) bytes payload refused\n", size);
+        wait_line_quiet(p_ses, p_ses->resp_timeout_ms / 10);
+    }
+
+    return ret_code;
+}
+
+int load_segment_data(bl602_session_t *p_ses, const image_view_t *p_eflash) {
+    int ret_code = 0;
+    pipeline_t pipe;
+    pipe_frame_t *p_frame = NULL;
+    uint32_t n_pkt = 0;         /* packets taken, the probe included */
+    uint32_t frame = 0;         /* of the pipeline, after the probe */
+    uint32_t offset = sizeof(Boot_Header_Config) + sizeof(segment_header_t);
+    uint32_t seg_len = 0;
+    uint32_t sent = 0;
+    uint32_t tries = 0;
+    bl_resp_t resp;
+
+    if (p_eflash == NULL) {
+        return -1;
     }
-    if (f_stat.st_size <= 176 + 16) {
-        fprintf(stderr, "ERROR: invalid file [%s]\n\n", eflash_file_name);
+    if (p_eflash->size <= offset) {
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: invalid eflash loader image\n\n");
         return -3;
     }
-    f = fopen(eflash_file_name, "r");
-    if (f == NULL) {
-        fprintf(stderr, "ERROR: unable to open file [%s]\n\n", eflash_file_name);
-        return -4;
+    /* the bootrom checks what it got against the segment header */
+    memcpy(&seg_len, p_eflash->p_data + sizeof(Boot_Header_Config)
+            + offsetof(segment_header_t, len), sizeof seg_len);
+    seg_len = le32toh(seg_len);
+    if (seg_len == 0 || seg_len > p_eflash->size - offset) {
+        flash_log(p_ses, BL602_LOG_ERROR,
+                "ERROR: segment of (%u) bytes in a loader of (%u) bytes\n\n",
+                seg_len, p_eflash->size - offset);
+        return -3;
     }
-    /* construct the packet to device and send */
-    /* skip the section of Boot_Header_Config and segment_header */
-    fseek(f, skip_len, SEEK_SET);
 
-    remain = f_stat.st_size - skip_len;
-    /* the binary may exeed the single packet size, do several arounds */
-    while (remain > 0) {
-        real_len = fread(&segment_data_pkt.seg_data[0], 1,
-                sizeof segment_data_pkt.seg_data, f);
-        remain = remain - real_len;
-        if (real_len <= 0 && ferror(f) != 0) {
-            fprintf(stderr, "ERROR: unexpected error in read\n\n");
-            ret_code = -5;
-            goto fail;
+    if (!p_ses->pkt.seg_payload_known) {
+        ret_code = probe_payload(p_ses, COMMAND_SEG_DATA, build_segment_data,
+                p_eflash->p_data + offset, seg_len, 0, SEG_DATA_MAX,
+                &p_ses->pkt.seg_payload, &p_ses->pkt.seg_payload_known, &sent);
+        if (ret_code != 0) {
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fail to load segement data\n\n");
+            return ret_code;
         }
+        offset += sent;
+        flash_log(p_ses, BL602_LOG_INFO,
+                "SUCCEED: load segment (%u) bytes data[%u]\n", sent, n_pkt++);
+    }
 
-        /* fill the header */
-        init_header(COMMAND_SEG_DATA, real_len, &segment_data_pkt.seg_data_hdr);
-        bytes_n = write(uart_fd, (void *)&segment_data_pkt, real_len +
-                sizeof(segment_data_pkt.seg_data_hdr));
-        if (bytes_n != real_len + sizeof(segment_data_pkt.seg_data_hdr)) {
+    /* the binary may exeed the single packet size, do several arounds */
+    ret_code = pipeline_start(&pipe, p_eflash->p_data + offset, seg_len - sent,
+            p_ses->pkt.seg_payload, 0, build_segment_data);
+    if (ret_code != 0) {
+        return ret_code;
+    }
+    while ((p_frame = next_frame(p_ses, &pipe, frame)) != NULL) {
+        if (send_frame(p_ses, p_frame, false) != 0) {
             ret_code = -1;
-            fprintf(stderr, "ERROR: incorrect number of bytes written\n");
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: incorrect number of bytes written\n");
             goto fail;
         }
 
         /* check response */
-        ret_code = read_check_response(uart_fd, NULL);
+        ret_code = read_check_response(p_ses, COMMAND_SEG_DATA, &resp, p_ses->resp_timeout_ms);
         if (ret_code == 0) {
-            fprintf(stdout, "SUCCEED: load segment (%d) bytes data[%d]\n", real_len, i++);
+            flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: load segment (%u) bytes data[%u]\n",
+                    p_frame->data_len, n_pkt++);
+            sent += p_frame->data_len;
+            frame++;
+            tries = 0;
+        } else if (error_class(ret_code, &resp) == ERR_REJECTED && tries++ < PKT_RETRY_MAX) {
+            /* refused as a whole, the bootrom still waits for this one */
+            flash_log(p_ses, BL602_LOG_WARNING,
+                    "WARNING: segment data[%u] refused, sent again\n", n_pkt);
+            p_ses->stats.resends++;
+            wait_line_quiet(p_ses, p_ses->resp_timeout_ms / 10);
+            continue;
         } else {
-            fprintf(stderr, "ERROR: fail to load segement data\n\n");
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fail to load segement data\n\n");
             goto fail;
         }
+        pipeline_release(&pipe);
+    }
+    if (sent != seg_len) {
+        flash_log(p_ses, BL602_LOG_ERROR,
+                "ERROR: (%u) bytes of segment data sent, (%u) expected\n\n",
+                sent, seg_len);
+        ret_code = -3;
+        goto fail;
     }
 
-    fprintf(stdout, "SUCCEED: load segment data\n\n");
+    flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: load segment data\n\n");
 fail:
-    fclose(f);
-
+    pipeline_stop(&pipe);
     return ret_code;
 }
 
-int check_image(int uart_fd) {
+int check_image(bl602_session_t *p_ses) {
     int ret_code = 0;
-    ssize_t bytes_n = 0;
     image_check_pkt_t img_check_pkt;
 
     init_header(COMMAND_IMG_CHECK, 0, &img_check_pkt.img_check_hdr);
-    bytes_n = write(uart_fd, &img_check_pkt, sizeof img_check_pkt);
-    if (bytes_n != sizeof img_check_pkt) {
+    if (send_packet(p_ses, &img_check_pkt, sizeof img_check_pkt) != 0) {
         ret_code = -1;
-        fprintf(stderr, "ERROR: incorrect number of bytes written\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: incorrect number of bytes written\n");
         goto fail;
     }
 
-    ret_code = read_check_response(uart_fd, NULL);
+    ret_code = read_check_response(p_ses, COMMAND_IMG_CHECK, NULL, p_ses->resp_timeout_ms);
     if (ret_code == 0) {
-        fprintf(stdout, "SUCCEED: check image\n\n");
+        flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: check image\n\n");
     } else {
-        fprintf(stderr, "ERROR: fail to check image\n\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fail to check image\n\n");
     }
 
 fail:
     return ret_code;
 }
 
-int run_image(int uart_fd) {
+int run_image(bl602_session_t *p_ses) {
     int ret_code = 0;
-    ssize_t bytes_n = 0;
     image_run_pkt_t img_run_pkt;
 
     init_header(COMMAND_IMG_RUN, 0, &img_run_pkt.img_run_hdr);
-    bytes_n = write(uart_fd, &img_run_pkt, sizeof img_run_pkt);
-    if (bytes_n != sizeof img_run_pkt) {
+    if (send_packet(p_ses, &img_run_pkt, sizeof img_run_pkt) != 0) {
         ret_code = -1;
-        fprintf(stderr, "ERROR: incorrect number of bytes written\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: incorrect number of bytes written\n");
         goto fail;
     }
 
-    ret_code = read_check_response(uart_fd, NULL);
+    ret_code = read_check_response(p_ses, COMMAND_IMG_RUN, NULL, p_ses->resp_timeout_ms);
     if (ret_code == 0) {
-        fprintf(stdout, "SUCCEED: run image\n\n");
+        flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: run image\n\n");
     } else {
-        fprintf(stderr, "ERROR: fail to run image\n\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fail to run image\n\n");
     }
 
 fail:
     return ret_code;
 }
 
-int erase_storage(int uart_fd, uint32_t start_addr, uint32_t len){
+/*
+ * erase [start_addr, start_addr + len), erase_ms is the worst case time
+ * the flash may take, 0 to assume the slowest sector erase throughout
+ */
+int erase_storage(bl602_session_t *p_ses, uint32_t start_addr, uint32_t len, uint32_t erase_ms){
     int ret_code = 0;
-    ssize_t bytes_n = 0;
     uint32_t i = 0;
-    uint32_t end_addr = start_addr + len;
+    /* the end address is inclusive, past it is the next sector */
+    uint32_t end_addr = start_addr + len - 1;
     erase_pkt_t erase_pkt;
     uint8_t *p_char = (uint8_t *) &erase_pkt;
     uint32_t off_start_crc = offsetof(packet_hdr_t, len_lsb);
 
+    if (len == 0) {
+        return 0;
+    }
     memset(&erase_pkt, 0, sizeof(erase_pkt));
     init_header(COMMAND_ERASE_FLASH, sizeof(erase_pkt.start_addr)
             + sizeof(erase_pkt.end_addr), &erase_pkt.erase_hdr);
@@ -652,19 +914,23 @@ int erase_storage(int uart_fd, uint32_t start_addr, uint32_t len){
     for (i = off_start_crc; i < sizeof (erase_pkt); i++) {
         erase_pkt.erase_hdr.rsvd_08 += p_char[i];
     }
-    bytes_n = write(uart_fd, &erase_pkt, sizeof erase_pkt);
-    if (bytes_n != sizeof erase_pkt) {
+    if (send_packet(p_ses, &erase_pkt, sizeof erase_pkt) != 0) {
         ret_code = -1;
-        fprintf(stderr, "ERROR: incorrect number of bytes written\n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: incorrect number of bytes written\n");
         goto fail;
     }
 
-    ret_code = read_check_response(uart_fd, NULL);
+    /* the erase time grows with the size */
+    if (erase_ms == 0) {
+        erase_ms = (len / 4096 + 1) * ERASE_TIMEOUT_PER_4K_MS;
+    }
+    ret_code = read_check_response(p_ses, COMMAND_ERASE_FLASH, NULL,
+            p_ses->resp_timeout_ms + erase_ms);
     if (ret_code == 0) {
-        fprintf(stdout, "SUCCEED: erase storage [0x%08x, 0x%08x]\n\n", start_addr,
+        flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: erase storage [0x%08x, 0x%08x]\n\n", start_addr,
                 end_addr);
     } else {
-        fprintf(stderr, "ERROR: erase storage [0x%08x, 0x%08x]\n\n", start_addr,
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: erase storage [0x%08x, 0x%08x]\n\n", start_addr,
                 end_addr);
     }
 
@@ -672,117 +938,390 @@ fail:
     return ret_code;
 }
 
-int flash_data(int uart_fd, uint8_t *p_data, uint32_t len_data, uint32_t target_addr) {
+/*
+ * erase the whole flash, erase_ms is the worst case time of the flash (timeCe)
+ */
+int erase_chip(bl602_session_t *p_ses, uint32_t erase_ms) {
     int ret_code = 0;
-    int i = 0;
-    int j = 0;
-    ssize_t bytes_n = 0;
-    uint8_t *p_curr = p_data;
-    uint8_t *p_char = NULL;
-    uint32_t len_to_send = 0;
-    uint32_t remain = len_data;
-    flash_data_pkt_t *p_pkt = NULL;
-
-    printf("start to flash data [%d] bytes\n", len_data);
-    while (p_curr < p_data + len_data) {
-        p_pkt = (flash_data_pkt_t *) malloc(sizeof(*p_pkt));
-        if (p_pkt == NULL) {
-            fprintf(stderr, "ERROR: failed to allocate memory\n\n");
-            return -1;
-        }
+    chip_erase_pkt_t chip_erase_pkt;
 
-        if (remain <= sizeof(p_pkt->data)) {
-            len_to_send = remain;
-        } else {
-            len_to_send = sizeof(p_pkt->data);
-        }
+    /* no payload, the checksum over len_lsb and len_msb stays 0 */
+    init_header(COMMAND_CHIP_ERASE, 0, &chip_erase_pkt.chip_erase_hdr);
+    if (send_packet(p_ses, &chip_erase_pkt, sizeof chip_erase_pkt) != 0) {
+        ret_code = -1;
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: incorrect number of bytes written\n");
+        goto fail;
+    }
+
+    ret_code = read_check_response(p_ses, COMMAND_CHIP_ERASE, NULL,
+            p_ses->resp_timeout_ms + erase_ms);
+    if (ret_code == 0) {
+        flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: erase chip\n\n");
+    } else {
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: erase chip\n\n");
+    }
+
+fail:
+    return ret_code;
+}
+
+/*
+ * The flash size from the JEDEC id the eflash loader reads out: the
+ * capacity byte is log2 of the size in bytes for the SPI NOR parts the
+ * BL 60x boards carry. 0 in *p_size if the byte makes no sense.
+ */
+int read_flash_size(bl602_session_t *p_ses, uint32_t *p_size) {
+    int ret_code = 0;
+    read_jid_pkt_t read_jid_pkt;
+    bl_resp_t bl_resp;
+
+    *p_size = 0;
+    /* no payload, the checksum over len_lsb and len_msb stays 0 */
+    init_header(COMMAND_READ_JID, 0, &read_jid_pkt.read_jid_hdr);
+    if (send_packet(p_ses, &read_jid_pkt, sizeof read_jid_pkt) != 0) {
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: incorrect number of bytes written\n");
+        return -1;
+    }
+
+    memset(&bl_resp, 0, sizeof bl_resp);
+    ret_code = read_check_response(p_ses, COMMAND_READ_JID, &bl_resp, p_ses->resp_timeout_ms);
+    if (ret_code != 0) {
+        flash_log(p_ses, BL602_LOG_WARNING, "WARNING: unable to read the flash id\n");
+        return ret_code;
+    }
+    /* 64 KB to 256 MB */
+    if (bl_resp.jid[2] >= 16 && bl_resp.jid[2] <= 28) {
+        *p_size = 1U << bl_resp.jid[2];
+    }
+    flash_log(p_ses, BL602_LOG_INFO, "flash id %02x %02x %02x, %u KB\n", bl_resp.jid[0],
+            bl_resp.jid[1], bl_resp.jid[2], *p_size / 1024);
+
+    return 0;
+}
+
+/*
+ * the header is followed by the target address, and covered by the
+ * checksum; the sum over the payload is taken where it is in the source
+ */
+static void build_data_pkt(uint8_t cmd_id, pipe_frame_t *p_frame, const uint8_t *p_data,
+        uint32_t data_len, uint32_t addr) {
+    flash_data_pkt_t *p_pkt = (flash_data_pkt_t *)p_frame->hdr;
+
+    init_header(cmd_id, data_len + sizeof(p_pkt->addr), &p_pkt->flash_data_hdr);
+    p_pkt->addr = htole32(addr);
+    /* fill crc: from len_lsb to the end of the payload, the sum is additive */
+    p_pkt->crc08 = checksum8(&p_pkt->len_lsb,
+            offsetof(flash_data_pkt_t, data) - offsetof(flash_data_pkt_t, len_lsb))
+        + checksum8(p_data, data_len);
+    p_frame->hdr_len = offsetof(flash_data_pkt_t, data);
+    p_frame->p_data = p_data;
+    p_frame->data_len = data_len;
+    p_frame->addr = addr;
+}
+
+static void build_flash_data(pipe_frame_t *p_frame, const uint8_t *p_data,
+        uint32_t data_len, uint32_t addr) {
+    build_data_pkt(COMMAND_FLASH_DATA, p_frame, p_data, data_len, addr);
+}
+
+/* same layout as flash data, the payload is a piece of an xz stream */
+static void build_flash_xz(pipe_frame_t *p_frame, const uint8_t *p_data,
+        uint32_t data_len, uint32_t addr) {
+    build_data_pkt(COMMAND_FLASH_XZ, p_frame, p_data, data_len, addr);
+}
+
+/*
+ * The packets are framed by the producer thread of a pipeline, this
+ * loop only writes them out and takes the acks.
+ *
+ * Up to the window of the session packets are kept in flight: the next
+ * packet goes over the wire while the device is still programming the
+ * previous one.
+ * The acks come back in order, each one retires the oldest packet. If the
+ * loader loses track (sequence error, overflow, garbled or no ack), the
+ * rest of the window is discarded, and with rewind set the data is sent
+ * again from the oldest unacked packet with one packet in flight, up to
+ * PKT_RETRY_MAX times in a row; flash programming only clears bits, so
+ * writing the same data twice is harmless. If the flash itself fails to
+ * take a packet, with rewind set FLASH_REWRITE is returned with the
+ * packets from it to the last one sent in *p_bad, for the caller to
+ * erase and write their sectors again.
+ */
+static int send_window(bl602_session_t *p_ses, pipeline_t *p_pipe, uint8_t cmd_id, bool rewind,
+        flash_run_t *p_bad) {
+    int ret_code = 0;
+    uint32_t depth = p_ses->window;
+    uint32_t sent = 0;          /* frames handed to the driver */
+    uint32_t acked = 0;         /* frames confirmed by the device */
+    uint32_t tries = 0;         /* of the oldest frame */
+    err_class_t err_class = ERR_FATAL;
+    pipe_frame_t *p_frame = NULL;
+    bl_resp_t resp;
+
+    if (depth < 1 || depth > FLASH_WINDOW_MAX) {
+        depth = (depth < 1) ? 1 : FLASH_WINDOW_MAX;
+    }
+    while (acked < p_pipe->n_frames) {
+        /* fill the window */
+        while (sent - acked < depth && (p_frame = next_frame(p_ses, p_pipe, sent)) != NULL) {
 #ifdef DEBUG
-        printf("remain = %d len_to_send = %d\n", remain, len_to_send);
+            flash_log(p_ses, BL602_LOG_DEBUG,
+                    "frame = %d len_to_send = %d\n", sent, p_frame->data_len);
 #endif
-        memset((void *)p_pkt, 0, sizeof(*p_pkt));
-        init_header(COMMAND_FLASH_DATA, len_to_send + sizeof(p_pkt->addr),
-                &(p_pkt->flash_data_hdr));
-        p_pkt->addr = htole32(target_addr);
-        memcpy(p_pkt->data, p_curr, len_to_send);
-        /* fill crc */
-        p_char = (uint8_t *) &p_pkt->len_lsb;
-        p_pkt->crc08 = 0;
-        for (i = 0; i < len_to_send + sizeof(p_pkt->addr) + 2; i++) {
-            p_pkt->crc08 += *p_char;
-            p_char++;
-        }
-        bytes_n = write(uart_fd, p_pkt, len_to_send + sizeof(p_pkt->addr)
-                + sizeof(p_pkt->flash_data_hdr));
-        if (bytes_n != len_to_send + sizeof(p_pkt->addr)
-                + sizeof(p_pkt->flash_data_hdr)) {
-            fprintf(stderr, "ERROR: incorrect number of bytes written\n");
-            ret_code = -2;
-            goto fail;
+            if (send_frame(p_ses, p_frame, sent != acked) != 0) {
+                flash_log(p_ses, BL602_LOG_ERROR, "ERROR: incorrect number of bytes written\n");
+                return -2;
+            }
+            sent++;
         }
 
-        /* check response */
-        ret_code = read_check_response(uart_fd, NULL);
+        /* the ack of the oldest packet */
+        ret_code = read_check_response(p_ses, cmd_id, &resp, p_ses->resp_timeout_ms);
         if (ret_code == 0) {
-            fprintf(stdout, "succeed: flash (%d) bytes data[%d] to "
-                    "addr 0x%08x\n", len_to_send, j++, target_addr);
-        } else {
-            fprintf(stderr, "ERROR: fail to flash data\n\n");
-            goto fail;
+            p_frame = pipeline_peek(p_pipe, acked);
+            flash_log(p_ses, BL602_LOG_INFO, "succeed: flash (%d) bytes data[%d] to "
+                    "addr 0x%08x\n", p_frame->data_len, acked, p_frame->addr);
+            /* xz packets are journaled by the caller, they carry no address */
+            if (cmd_id == COMMAND_FLASH_DATA) {
+                journal_acked(&p_ses->journal, p_frame->addr, p_frame->data_len,
+                        p_pipe->p_src + (p_frame->addr - p_pipe->target_addr));
+            }
+            pipeline_release(p_pipe);
+            acked++;
+            tries = 0;
+            continue;
+        }
+        err_class = error_class(ret_code, &resp);
+        if (rewind && (err_class == ERR_REJECTED || err_class == ERR_LOST)
+                && tries++ < PKT_RETRY_MAX) {
+            if (depth > 1) {
+                flash_log(p_ses, BL602_LOG_WARNING, "WARNING: loader lost packets in flight, "
+                        "back to one packet at a time\n");
+                /* stay at depth 1 for the rest of the session */
+                depth = p_ses->window = 1;
+            } else {
+                flash_log(p_ses, BL602_LOG_WARNING, "WARNING: flash data[%u] sent again\n", acked);
+            }
+            p_ses->stats.resends++;
+            wait_line_quiet(p_ses, p_ses->resp_timeout_ms / 10);
+            sent = acked;
+            continue;
         }
+        if (rewind && err_class == ERR_WRITE) {
+            /* the packets still in flight may have failed as well */
+            p_frame = pipeline_peek(p_pipe, acked);
+            p_bad->addr = p_frame->addr;
+            p_frame = pipeline_peek(p_pipe, sent - 1);
+            p_bad->len = p_frame->addr + p_frame->data_len - p_bad->addr;
+            wait_line_quiet(p_ses, p_ses->resp_timeout_ms / 10);
+            return FLASH_REWRITE;
+        }
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fail to flash data\n\n");
+        return ret_code;
+    }
 
-        /* move to the next frame */
-        p_curr = p_curr + len_to_send;
-        target_addr = target_addr + len_to_send;
-        remain = remain - len_to_send;
+    return 0;
+}
 
-        free(p_pkt);
-        p_pkt = NULL;
+/*
+ * Find the largest flash data packet the loader takes, with packets of
+ * 0xFF: programming them changes nothing, wherever addr is.
+ */
+int probe_flash_payload(bl602_session_t *p_ses, uint32_t addr) {
+    int ret_code = 0;
+    uint8_t *p_blank = NULL;
+    uint32_t sent = 0;
+
+    if (p_ses->pkt.flash_payload_known) {
+        return 0;
+    }
+    p_blank = malloc(FLASH_DATA_MAX);
+    if (p_blank == NULL) {
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: malloc fail for the packet probe\n");
+        return -1;
+    }
+    memset(p_blank, 0xFF, FLASH_DATA_MAX);
+    ret_code = probe_payload(p_ses, COMMAND_FLASH_DATA, build_flash_data, p_blank,
+            FLASH_DATA_MAX, addr, FLASH_DATA_MAX, &p_ses->pkt.flash_payload,
+            &p_ses->pkt.flash_payload_known, &sent);
+    free(p_blank);
+    if (ret_code != 0) {
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: no flash data packet size works\n\n");
     }
 
-fail:
-    if (p_pkt != NULL) {
-        free(p_pkt);
+    return ret_code;
+}
+
+/*
+ * The flash failed to program the packets *p_bad: erase their sectors
+ * again, and cut the runs down to what is to be written from the start
+ * of the first sector on (not before target_addr).
+ */
+static int rewrite_sectors(bl602_session_t *p_ses, const flash_run_t *p_bad, uint32_t target_addr,
+        flash_run_t *p_runs, uint32_t *p_n_runs) {
+    uint32_t sector = p_ses->sector_size;
+    uint32_t start = p_bad->addr / sector * sector;
+    uint32_t end = (p_bad->addr + p_bad->len + sector - 1) / sector * sector;
+    uint32_t r = 0;
+    uint32_t n = 0;
+    int ret_code = 0;
+
+    flash_log(p_ses, BL602_LOG_WARNING, "WARNING: flash write at 0x%08x failed, "
+            "erasing [0x%08x, 0x%08x] again\n", p_bad->addr, start, end - 1);
+    p_ses->stats.rewrites++;
+    ret_code = erase_storage(p_ses, start, end - start, 0);
+    if (ret_code != 0) {
+        return ret_code;
+    }
+    if (start < target_addr) {
+        start = target_addr;
+    }
+    for (r = 0; r < *p_n_runs; r++) {
+        if (p_runs[r].addr + p_runs[r].len <= start) {
+            continue;
+        }
+        p_runs[n] = p_runs[r];
+        if (p_runs[n].addr < start) {
+            p_runs[n].len -= start - p_runs[n].addr;
+            p_runs[n].addr = start;
+        }
+        n++;
+    }
+    *p_n_runs = n;
+
+    return 0;
+}
+
+/*
+ * With erased set, the target range is known to be blank, so the 0xFF
+ * parts of the data (the pad after a boot header, tails of the images)
+ * are not sent at all.
+ */
+int flash_data(bl602_session_t *p_ses, uint8_t *p_data, uint32_t len_data, uint32_t target_addr,
+        bool erased) {
+    int ret_code = 0;
+    flash_run_t *p_runs = NULL;
+    flash_run_t run = {target_addr, len_data};
+    flash_run_t bad = {0, 0};
+    uint32_t n_runs = 1;
+    uint32_t len_send = len_data;
+    uint32_t last_bad = 0;
+    uint32_t rewrites = 0;
+    uint32_t r = 0;
+    pipeline_t pipe;
+
+    if (erased) {
+        p_runs = malloc(PLAN_SPARSE_MAX_RUNS(len_data) * sizeof(flash_run_t));
+        if (p_runs == NULL) {
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: malloc fail for the sparse runs\n");
+            return -1;
+        }
+        n_runs = plan_sparse(p_data, len_data, target_addr, p_runs);
+        for (r = 0, len_send = 0; r < n_runs; r++) {
+            len_send += p_runs[r].len;
+        }
+    }
+    flash_log(p_ses, BL602_LOG_INFO, "start to flash data [%d] bytes", len_data);
+    if (len_send != len_data) {
+        flash_log(p_ses, BL602_LOG_INFO, ", [%d] bytes of 0xFF skipped", len_data - len_send);
+    }
+    flash_log(p_ses, BL602_LOG_INFO, "\n");
+    if (!erased) {
+        p_runs = &run;
+    }
+    while (1) {
+        ret_code = pipeline_start_runs(&pipe, p_data, target_addr, p_runs, n_runs,
+                p_ses->pkt.flash_payload, build_flash_data);
+        if (ret_code != 0) {
+            break;
+        }
+        ret_code = send_window(p_ses, &pipe, COMMAND_FLASH_DATA, true, &bad);
+        pipeline_stop(&pipe);
+        if (ret_code != FLASH_REWRITE) {
+            break;
+        }
+        /* the same sectors failing again and again are worn out */
+        rewrites = (bad.addr == last_bad) ? rewrites + 1 : 1;
+        last_bad = bad.addr;
+        if (rewrites > PKT_RETRY_MAX) {
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: flash write at 0x%08x keeps failing\n\n",
+                    bad.addr);
+            ret_code = -3;
+            break;
+        }
+        ret_code = rewrite_sectors(p_ses, &bad, target_addr, p_runs, &n_runs);
+        if (ret_code != 0) {
+            break;
+        }
     }
+    if (erased) {
+        free(p_runs);
+    }
+
     return ret_code;
 }
 
-int notify_flash_done(int uart_fd) {
+/*
+ * The loader feeds the xz stream to its decoder, and programs the output
+ * from target_addr on. A packet taken twice would corrupt the stream, so
+ * the window is never rewound here; the program done command which ends
+ * the image closes the stream, so there is one stream per image.
+ */
+int flash_data_xz(bl602_session_t *p_ses, const uint8_t *p_xz, uint32_t len_xz,
+        uint32_t target_addr) {
+    int ret_code = 0;
+    pipeline_t pipe;
+
+    flash_log(p_ses, BL602_LOG_INFO, "start to flash [%d] bytes of xz data\n", len_xz);
+    ret_code = pipeline_start(&pipe, p_xz, len_xz, p_ses->pkt.flash_payload, target_addr,
+            build_flash_xz);
+    if (ret_code != 0) {
+        return ret_code;
+    }
+    ret_code = send_window(p_ses, &pipe, COMMAND_FLASH_XZ, false, NULL);
+    pipeline_stop(&pipe);
+
+    return ret_code;
+}
+
+int notify_flash_done(bl602_session_t *p_ses) {
     int ret_code = 0;
-    ssize_t bytes_n = 0;
     flash_done_pkt_t flash_done_pkt;
 
     memset(&flash_done_pkt, 0, sizeof (flash_done_pkt));
     init_header(COMMAND_PROG_OK, 0, &flash_done_pkt.flash_done_hdr);
 
-    bytes_n = write(uart_fd, &flash_done_pkt, sizeof flash_done_pkt);
-    if (bytes_n != sizeof flash_done_pkt) {
-        fprintf(stderr, "ERROR: incorrect number of bytes written\n");
+    if (send_packet(p_ses, &flash_done_pkt, sizeof flash_done_pkt) != 0) {
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: incorrect number of bytes written\n");
         ret_code = 1;
         goto fail;
     }
 
-    ret_code = read_check_response(uart_fd, NULL);
+    ret_code = read_check_response(p_ses, COMMAND_PROG_OK, NULL, p_ses->resp_timeout_ms);
     if (ret_code == 0) {
-        fprintf(stdout, "SUCCEED: ack flash ok\n\n");
+        flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: ack flash ok\n\n");
     } else {
-        fprintf(stderr, "ERROR: nack flash \n\n" );
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: nack flash \n\n" );
     }
 
 fail:
     return ret_code;
 }
 
-int send_sha256(int uart_fd, uint32_t *sha256, uint32_t start_addr, uint32_t size) {
+/*
+ * ask the device for SHA256 of the flash range [start_addr, start_addr + size),
+ * the result is in the same word order as calc_sha256
+ */
+int request_sha256(bl602_session_t *p_ses, uint32_t start_addr, uint32_t size, uint32_t *p_sha256) {
     int ret_code = 0;
     sha256_pkt_t sha256_pkt;
     bl_resp_t bl_resp;
-    ssize_t bytes_n = 0;
     uint8_t *p_char = (uint8_t *)&sha256_pkt;
     uint32_t i = 0;
     uint32_t crc_start = offsetof(sha256_pkt_t, sha256_hdr)
         + offsetof(packet_hdr_t, len_lsb);
 #ifdef DEBUG
-    printf("entering send_sha256\n");
+    flash_log(p_ses, BL602_LOG_DEBUG, "entering request_sha256\n");
 #endif
     memset((void *)&sha256_pkt, 0, sizeof(sha256_pkt));
     init_header(COMMAND_SHA_256, sizeof(sha256_pkt.start_addr)
@@ -791,7 +1330,8 @@ int send_sha256(int uart_fd, uint32_t *sha256, uint32_t start_addr, uint32_t siz
     sha256_pkt.start_addr = htole32(start_addr);
     sha256_pkt.size = htole32(size);
 #ifdef DEBUG
-    printf("***** start_addr = 0x%x size = 0x%x  ****\n", sha256_pkt.start_addr,
+    flash_log(p_ses, BL602_LOG_DEBUG,
+            "***** start_addr = 0x%x size = 0x%x  ****\n", sha256_pkt.start_addr,
             sha256_pkt.size);
 #endif
     /* calculate CRC  and fill into resv08 */
@@ -799,69 +1339,79 @@ int send_sha256(int uart_fd, uint32_t *sha256, uint32_t start_addr, uint32_t siz
         sha256_pkt.sha256_hdr.rsvd_08 += p_char[i];
     }
 
-    bytes_n = write(uart_fd, &sha256_pkt, sizeof sha256_pkt);
-    if (bytes_n != sizeof sha256_pkt) {
+    if (send_packet(p_ses, &sha256_pkt, sizeof sha256_pkt) != 0) {
         ret_code = 1;
-        fprintf(stderr, "ERROR: fewer bytes written \n");
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fewer bytes written \n");
         goto fail;
     }
 
     memset(&bl_resp, 0, sizeof bl_resp);
-    ret_code = read_check_response(uart_fd, &bl_resp);
-
+    ret_code = read_check_response(p_ses, COMMAND_SHA_256, &bl_resp, p_ses->resp_timeout_ms);
     if (ret_code == 0) {
         /* somehow the order from device is different */
-        for (int i =0; i < 8; i++) {
-            bl_resp.sha256[i] = be32toh(bl_resp.sha256[i]);
+        for (i = 0; i < 8; i++) {
+            p_sha256[i] = be32toh(bl_resp.sha256[i]);
         }
+    } else {
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: fail in getting response for SHA256 \n\n" );
+    }
+
+fail:
+    return ret_code;
+}
+
+int send_sha256(bl602_session_t *p_ses, uint32_t *sha256, uint32_t start_addr, uint32_t size) {
+    int ret_code = 0;
+    uint32_t dev_sha256[8] = {0};
 
+    ret_code = request_sha256(p_ses, start_addr, size, dev_sha256);
+    if (ret_code == 0) {
         /* compare the sha256 from device with our local */
-        ret_code = memcmp(sha256, bl_resp.sha256, sizeof(bl_resp.sha256));
+        ret_code = memcmp(sha256, dev_sha256, sizeof(dev_sha256));
         if (ret_code == 0) {
-            fprintf(stdout, "SUCCEED: SHA256 verificatin pass\n\n");
+            flash_log(p_ses, BL602_LOG_INFO, "SUCCEED: SHA256 verificatin pass\n\n");
         } else {
-            fprintf(stderr, "ERROR: SHA256 verificatin fail, but ignore now\n");
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: SHA256 verificatin fail\n");
             for (int i =0; i < 8; i++) {
-                printf("sha256[%d] = 0x%08x bl_resp.sha256[%d] = 0x%08x %s\n",
+                flash_log(p_ses, BL602_LOG_INFO,
+                        "sha256[%d] = 0x%08x bl_resp.sha256[%d] = 0x%08x %s\n",
                         i, sha256[i],
-                        i, bl_resp.sha256[i],
-                        (sha256[i] == bl_resp.sha256[i] ? " ":"X")
+                        i, dev_sha256[i],
+                        (sha256[i] == dev_sha256[i] ? " ":"X")
                         );
             }
-            ret_code = 0;
+            /* the flash does not hold the image, the board is not flashed */
+            ret_code = -2;
         }
-    } else {
-        fprintf(stderr, "ERROR: fail in getting response for SHA256 \n\n" );
     }
 
-fail:
     return ret_code;
 }
 
-int send_finish(int uart_fd, uint32_t baud_rate) {
+int send_finish(bl602_session_t *p_ses, uint32_t baud_rate) {
     /*
      * uart_fd might be open for different baud_rate from this.
-     * And note: cfsetospeed only supports up to 230400. Thus,
-     * skip this now. If really necessary, close this fd, open it
-     * with this_baud_rate, and try to hand_shake.
+     * uart_set_baud_rate can switch to any rate now, but the eflash
+     * loader does not answer the hand shake after flashing (see open
+     * issues in README). Thus, skip this now.
      */
     return 0;
-    /* return hand_shake(uart_fd, baud_rate); */
+    /* return hand_shake(p_ses, baud_rate); */
 }
 
-int load_pub_key(int uart_fd) {
+int load_pub_key(bl602_session_t *p_ses) {
     int ret_code = 0;
 
     return ret_code;
 }
 
-int load_signature(int uart_fd) {
+int load_signature(bl602_session_t *p_ses) {
     int ret_code = 0;
 
     return ret_code;
 }
 
-int load_aes_iv(int uart_fd) {
+int load_aes_iv(bl602_session_t *p_ses) {
     int ret_code = 0;
 
     return ret_code;
@@ -23,39 +23,56 @@
 
 #include "packet_comm.h"
 
-/*XXX: move read_to_buf and dump_hex  out of common.* */
-int read_to_buf(char *p_file_name, uint8_t **p_buf, uint32_t *p_sz_data);
+#include "image.h"
+#include "bl602flash.h"
+
+/* flash_data packets kept in flight without an ack, 1 is stop-and-wait */
+#define FLASH_WINDOW_MAX    16
 
 void dump_hex(const char *prefix, uint8_t *p_data, uint32_t len);
 
-int hand_shake(int uart_fd, uint32_t baud_rate);
+/* the commands below work on the board of p_ses, its UART open */
+
+int hand_shake(bl602_session_t *p_ses, uint32_t baud_rate);
+
+int load_boot_header(bl602_session_t *p_ses, const image_view_t *p_eflash);
+
+int request_boot_info(bl602_session_t *p_ses, boot_info_t *p_boot_info);
+
+int load_pub_key(bl602_session_t *p_ses);
+
+int load_signature(bl602_session_t *p_ses);
+
+int load_aes_iv(bl602_session_t *p_ses);
 
-int load_boot_header(int uart_fd, char *eflash_file_name);
+int load_segment_header(bl602_session_t *p_ses, const image_view_t *p_eflash);
 
-int request_boot_info(int uart_fd, boot_info_t *p_boot_info);
+int load_segment_data(bl602_session_t *p_ses, const image_view_t *p_eflash);
 
-int load_pub_key(int uart_fd);
+int check_image(bl602_session_t *p_ses);
 
-int load_signature(int uart_fd);
+int run_image(bl602_session_t *p_ses);
 
-int load_aes_iv(int uart_fd);
+int erase_storage(bl602_session_t *p_ses, uint32_t start_addr, uint32_t len, uint32_t erase_ms);
 
-int load_segment_header(int uart_fd, char *eflash_file_name);
+int erase_chip(bl602_session_t *p_ses, uint32_t erase_ms);
 
-int load_segment_data(int uart_fd, char *eflash_file_name);
+int read_flash_size(bl602_session_t *p_ses, uint32_t *p_size);
 
-int check_image(int uart_fd);
+int probe_flash_payload(bl602_session_t *p_ses, uint32_t addr);
 
-int run_image(int uart_fd);
+int flash_data(bl602_session_t *p_ses, uint8_t *data, uint32_t len_data, uint32_t target_addr,
+        bool erased);
 
-int erase_storage(int uart_fd, uint32_t start_addr, uint32_t len);
+int flash_data_xz(bl602_session_t *p_ses, const uint8_t *p_xz, uint32_t len_xz,
+        uint32_t target_addr);
 
-int flash_data(int uart_fd, uint8_t *data, uint32_t len_data, uint32_t target_addr);
+int notify_flash_done(bl602_session_t *p_ses);
 
-int notify_flash_done(int uart_fd);
+int request_sha256(bl602_session_t *p_ses, uint32_t start_addr, uint32_t len, uint32_t *p_sha256);
 
-int send_sha256(int uart_fd, uint32_t *sha256, uint32_t start_addr, uint32_t len);
+int send_sha256(bl602_session_t *p_ses, uint32_t *sha256, uint32_t start_addr, uint32_t len);
 
-int send_finish(int uart_fd, uint32_t baud_rate);
+int send_finish(bl602_session_t *p_ses, uint32_t baud_rate);
 
 #endif /* _COMM_H */
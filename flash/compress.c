@@ -0,0 +1,100 @@
+/*
+ * xz compression of the images for the decompressing write of the eflash loader
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <lzma.h>
+
+#include "compress.h"
+#include "session.h"
+
+#define COMPRESS_THREADS_MAX    16
+
+int compress_data(const uint8_t *p_data, uint32_t len, uint8_t **pp_xz, uint32_t *p_len_xz) {
+    int ret_code = 0;
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_options_lzma opt;
+    lzma_filter filters[2];
+    lzma_mt mt;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint8_t *p_xz = NULL;
+    size_t out_max = lzma_stream_buffer_bound(len);
+    lzma_ret ret;
+
+    if (lzma_lzma_preset(&opt, LZMA_PRESET_DEFAULT)) {
+        return -1;
+    }
+    opt.dict_size = COMPRESS_CHUNK;
+    filters[0].id = LZMA_FILTER_LZMA2;
+    filters[0].options = &opt;
+    filters[1].id = LZMA_VLI_UNKNOWN;
+    filters[1].options = NULL;
+
+    memset(&mt, 0, sizeof mt);
+    mt.threads = (cpus < 1) ? 1 : (uint32_t)cpus;
+    if (mt.threads > COMPRESS_THREADS_MAX) {
+        mt.threads = COMPRESS_THREADS_MAX;
+    }
+    mt.block_size = COMPRESS_CHUNK;
+    mt.filters = filters;
+    mt.check = LZMA_CHECK_CRC32;
+
+    p_xz = malloc(out_max);
+    if (p_xz == NULL) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: malloc fail for compression\n");
+        return -1;
+    }
+    if (lzma_stream_encoder_mt(&strm, &mt) != LZMA_OK) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: unable to start the xz encoder\n");
+        ret_code = -2;
+        goto fail;
+    }
+    strm.next_in = p_data;
+    strm.avail_in = len;
+    strm.next_out = p_xz;
+    strm.avail_out = out_max;
+    do {
+        ret = lzma_code(&strm, LZMA_FINISH);
+    } while (ret == LZMA_OK);
+    if (ret != LZMA_STREAM_END) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: xz compression fail\n");
+        ret_code = -2;
+        goto fail;
+    }
+    *pp_xz = p_xz;
+    *p_len_xz = (uint32_t)strm.total_out;
+    p_xz = NULL;
+
+fail:
+    lzma_end(&strm);
+    free(p_xz);
+    return ret_code;
+}
+
+bool compress_pays(uint32_t len_raw, uint32_t len_xz, uint32_t len, uint32_t baud) {
+    double bytes_per_s = baud / 10.0;
+    double t_raw = len_raw / bytes_per_s;
+    double t_xz = len_xz / bytes_per_s + (double)len / COMPRESS_DEVICE_BPS;
+
+    return t_xz < t_raw;
+}
@@ -0,0 +1,47 @@
+/*
+ * xz compression of the images for the decompressing write of the eflash loader
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The data goes into a single xz stream, cut into independent blocks of
+ * COMPRESS_CHUNK bytes so that the blocks are compressed on all cores at
+ * once (lzma_stream_encoder_mt). The dictionary is no larger than a
+ * block, the loader decodes with little RAM.
+ */
+#define COMPRESS_CHUNK          (64 * 1024)
+
+/* bytes/s the loader decompresses and programs, on top of the raw path */
+#define COMPRESS_DEVICE_BPS     (2 * 1024 * 1024)
+
+/* *pp_xz is allocated */
+int compress_data(const uint8_t *p_data, uint32_t len, uint8_t **pp_xz, uint32_t *p_len_xz);
+
+/*
+ * The time-cost model: at baud (10 bits a byte on the wire), is sending
+ * len_xz bytes to be decompressed by the loader into len bytes faster
+ * than sending len_raw bytes as they are?
+ */
+bool compress_pays(uint32_t len_raw, uint32_t len_xz, uint32_t len, uint32_t baud);
+
+#endif /* _COMPRESS_H */
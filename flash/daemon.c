@@ -0,0 +1,356 @@
+/*
+ * flash daemon, the plans held in memory and the jobs taken on a socket
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "comm.h"
+#include "daemon.h"
+#include "common_share.h"
+
+/* one client */
+typedef struct {
+    int fd;
+    const daemon_plan_t *p_plans;
+    uint32_t n_plans;
+} daemon_client_t;
+
+/* the ports being flashed, a port takes one job at a time */
+static pthread_mutex_t busy_lock = PTHREAD_MUTEX_INITIALIZER;
+static char busy_ports[FLASH_PORTS_MAX][64];
+
+static void reply(int fd, const char *p_fmt, ...)
+{
+    va_list args;
+
+    va_start(args, p_fmt);
+    /* a client gone does not stop the job */
+    (void) vdprintf(fd, p_fmt, args);
+    va_end(args);
+}
+
+static bool port_take(const char *p_port)
+{
+    int free_slot = -1;
+    int i = 0;
+
+    if (strlen(p_port) >= sizeof(busy_ports[0])) {
+        return false;
+    }
+    pthread_mutex_lock(&busy_lock);
+    for (i = 0; i < FLASH_PORTS_MAX; i++) {
+        if (strcmp(busy_ports[i], p_port) == 0) {
+            pthread_mutex_unlock(&busy_lock);
+            return false;
+        }
+        if (busy_ports[i][0] == '\0' && free_slot < 0) {
+            free_slot = i;
+        }
+    }
+    if (free_slot >= 0) {
+        strcpy(busy_ports[free_slot], p_port);
+    }
+    pthread_mutex_unlock(&busy_lock);
+
+    return free_slot >= 0;
+}
+
+static void port_release(const char *p_port)
+{
+    int i = 0;
+
+    pthread_mutex_lock(&busy_lock);
+    for (i = 0; i < FLASH_PORTS_MAX; i++) {
+        if (strcmp(busy_ports[i], p_port) == 0) {
+            busy_ports[i][0] = '\0';
+            break;
+        }
+    }
+    pthread_mutex_unlock(&busy_lock);
+}
+
+/*
+ * the request line, without its end of line. A client sends one request
+ * per connection, whatever follows the line is dropped.
+ */
+static int read_line(int fd, char *p_line, uint32_t size)
+{
+    uint32_t len = 0;
+    char *p_end = NULL;
+    ssize_t n = 0;
+
+    while (len < size - 1) {
+        n = read(fd, &p_line[len], size - 1 - len);
+        if (n <= 0) {
+            break;
+        }
+        p_end = memchr(&p_line[len], '\n', n);
+        if (p_end != NULL) {
+            len = p_end - p_line;
+            break;
+        }
+        len += n;
+    }
+    if (len > 0 && p_line[len - 1] == '\r') {
+        len--;
+    }
+    p_line[len] = '\0';
+
+    return (n < 0) ? -1 : 0;
+}
+
+/* the options of a job, over the defaults of its plan */
+static int parse_options(char **pp_save, flash_config_t *p_cfg, char *p_why, uint32_t why_len)
+{
+    char *p_opt = NULL;
+    char *p_arg = NULL;
+
+    while ((p_opt = strtok_r(NULL, " \t", pp_save)) != NULL) {
+        if (strcmp(p_opt, "--skip-unchanged") == 0) {
+            p_cfg->skip_unchanged = true;
+        } else if (strcmp(p_opt, "--delta") == 0) {
+            p_cfg->delta = true;
+        } else if (strcmp(p_opt, "--compress") == 0) {
+            p_cfg->compress = true;
+        } else if (strcmp(p_opt, "--chip-erase") == 0) {
+            p_cfg->chip_erase = CHIP_ERASE_ON;
+            /* "auto" is the only word which may follow */
+            if (*pp_save != NULL && strncmp(*pp_save, "auto", 4) == 0
+                    && ((*pp_save)[4] == '\0' || (*pp_save)[4] == ' ')) {
+                (void) strtok_r(NULL, " \t", pp_save);
+                p_cfg->chip_erase = CHIP_ERASE_AUTO;
+            }
+        } else if (strcmp(p_opt, "--rate") == 0 || strcmp(p_opt, "--flash-rate") == 0
+                || strcmp(p_opt, "--window") == 0) {
+            p_arg = strtok_r(NULL, " \t", pp_save);
+            if (p_arg == NULL) {
+                snprintf(p_why, why_len, "missing an argument for %s", p_opt);
+                return -1;
+            }
+            if (strcmp(p_opt, "--rate") == 0) {
+                p_cfg->baud_rate = atoi(p_arg);
+            } else if (strcmp(p_opt, "--flash-rate") == 0) {
+                p_cfg->flash_rate = atoi(p_arg);
+            } else {
+                p_cfg->window = atoi(p_arg);
+                if (p_cfg->window < 1 || p_cfg->window > FLASH_WINDOW_MAX) {
+                    snprintf(p_why, why_len, "window should be 1 ~ %d", FLASH_WINDOW_MAX);
+                    return -1;
+                }
+            }
+        } else {
+            snprintf(p_why, why_len, "unknown option %s", p_opt);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void on_step(void *p_user, flash_state_t state)
+{
+    reply(*(int *)p_user, "step %s\n", flash_state_name(state));
+}
+
+/* flash <uart_device> <plan> [options] */
+static void serve_flash(daemon_client_t *p_client, char **pp_save)
+{
+    const daemon_plan_t *p_plan = NULL;
+    flash_config_t cfg;
+    bl602_session_t *p_ses = NULL;
+    bl602_stats_t stats;
+    char *p_uart = NULL;
+    char *p_name = NULL;
+    char why[128];
+    uint32_t i = 0;
+    int ret_code = 0;
+
+    p_uart = strtok_r(NULL, " \t", pp_save);
+    p_name = strtok_r(NULL, " \t", pp_save);
+    if (p_uart == NULL || p_name == NULL) {
+        reply(p_client->fd, "error usage: flash <uart_device> <plan> [options]\n");
+        return;
+    }
+    for (i = 0; i < p_client->n_plans; i++) {
+        if (strcmp(p_client->p_plans[i].p_name, p_name) == 0) {
+            p_plan = &p_client->p_plans[i];
+            break;
+        }
+    }
+    if (p_plan == NULL) {
+        reply(p_client->fd, "error no plan %s\n", p_name);
+        return;
+    }
+    /* the images and their hashes are shared, only the options are copied */
+    cfg = p_plan->cfg;
+    if (parse_options(pp_save, &cfg, why, sizeof why) != 0) {
+        reply(p_client->fd, "error %s\n", why);
+        return;
+    }
+    if (!port_take(p_uart)) {
+        reply(p_client->fd, "error %s is busy\n", p_uart);
+        return;
+    }
+
+    p_ses = bl602_session_new(p_uart, &cfg);
+    if (p_ses == NULL) {
+        port_release(p_uart);
+        reply(p_client->fd, "error out of memory\n");
+        return;
+    }
+    bl602_session_set_step(p_ses, on_step, &p_client->fd);
+    fprintf(stdout, "%s: plan %s\n", p_uart, p_plan->p_name);
+    ret_code = bl602_session_run(p_ses);
+    bl602_session_stats(p_ses, &stats);
+    bl602_session_free(p_ses);
+    port_release(p_uart);
+
+    if (ret_code == 0) {
+        fprintf(stdout, "SUCCEED: %s in %.1f s\n", p_uart, stats.elapsed_us / 1e6);
+        reply(p_client->fd, "ok %.1f\n", stats.elapsed_us / 1e6);
+    } else {
+        fprintf(stdout, "FAIL: %s (%d) at %s after %.1f s\n", p_uart, ret_code,
+                (stats.p_failed_step != NULL) ? stats.p_failed_step : "start",
+                stats.elapsed_us / 1e6);
+        reply(p_client->fd, "fail %d %.1f %s\n", ret_code, stats.elapsed_us / 1e6,
+                (stats.p_failed_step != NULL) ? stats.p_failed_step : "start");
+    }
+}
+
+/* plans: one line per plan and per image */
+static void serve_plans(daemon_client_t *p_client)
+{
+    const flash_config_t *p_cfg = NULL;
+    uint32_t i = 0;
+    uint32_t j = 0;
+
+    for (i = 0; i < p_client->n_plans; i++) {
+        p_cfg = &p_client->p_plans[i].cfg;
+        reply(p_client->fd, "plan %s %u\n", p_client->p_plans[i].p_name, p_cfg->n_jobs);
+        for (j = 0; j < p_cfg->n_jobs; j++) {
+            reply(p_client->fd, "image %s 0x%08x %u %08x\n", p_cfg->jobs[j].p_name,
+                    p_cfg->jobs[j].dst, p_cfg->jobs[j].image.size,
+                    p_cfg->jobs[j].sha_256[0]);
+        }
+    }
+    reply(p_client->fd, "ok\n");
+}
+
+static void *client_thread(void *p_arg)
+{
+    daemon_client_t *p_client = (daemon_client_t *)p_arg;
+    char line[DAEMON_LINE_MAX];
+    char *p_save = NULL;
+    char *p_cmd = NULL;
+
+    if (read_line(p_client->fd, line, sizeof line) == 0) {
+        p_cmd = strtok_r(line, " \t", &p_save);
+        if (p_cmd == NULL) {
+            reply(p_client->fd, "error empty request\n");
+        } else if (strcmp(p_cmd, "flash") == 0) {
+            serve_flash(p_client, &p_save);
+        } else if (strcmp(p_cmd, "plans") == 0) {
+            serve_plans(p_client);
+        } else {
+            reply(p_client->fd, "error unknown request %s\n", p_cmd);
+        }
+    }
+    close(p_client->fd);
+    free(p_client);
+
+    return NULL;
+}
+
+int daemon_run(const char *p_sock_path, const daemon_plan_t *p_plans, uint32_t n_plans)
+{
+    struct sockaddr_un addr;
+    daemon_client_t *p_client = NULL;
+    pthread_t thread;
+    int sock_fd = -1;
+    int fd = -1;
+    mode_t old_mask = 0;
+    int ret = 0;
+
+    if (strlen(p_sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: socket path too long %s\n", p_sock_path);
+        return -1;
+    }
+    /* a client which goes away must not take the daemon with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        perror("socket");
+        return -2;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, p_sock_path);
+    /* left over by a daemon before */
+    (void) unlink(p_sock_path);
+    /*
+     * the daemon opens any port a client names, often as root: only the
+     * user and the group of the daemon may connect (srw-rw----)
+     */
+    old_mask = umask(0117);
+    ret = bind(sock_fd, (struct sockaddr *)&addr, sizeof addr);
+    (void) umask(old_mask);
+    if (ret != 0 || listen(sock_fd, FLASH_PORTS_MAX) != 0) {
+        perror(p_sock_path);
+        close(sock_fd);
+        return -2;
+    }
+    fprintf(stdout, "listening on %s, %u plans\n", p_sock_path, n_plans);
+
+    while (1) {
+        fd = accept(sock_fd, NULL, NULL);
+        if (fd < 0) {
+            perror("accept");
+            continue;
+        }
+        p_client = malloc(sizeof(*p_client));
+        if (p_client == NULL) {
+            close(fd);
+            continue;
+        }
+        p_client->fd = fd;
+        p_client->p_plans = p_plans;
+        p_client->n_plans = n_plans;
+        /* one thread per client, so the boards are flashed side by side */
+        if (pthread_create(&thread, NULL, client_thread, p_client) != 0) {
+            fprintf(stderr, "ERROR: unable to start a thread for a client\n");
+            close(fd);
+            free(p_client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return 0;
+}
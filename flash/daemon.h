@@ -0,0 +1,48 @@
+/*
+ * flash daemon, the plans held in memory and the jobs taken on a socket
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <stdint.h>
+
+#include "bl602flash.h"
+
+#define DAEMON_PLANS_MAX    16
+#define DAEMON_LINE_MAX     512
+
+/* a bundle loaded once, flashed by name */
+typedef struct {
+    const char *p_name;
+    flash_config_t cfg;
+} daemon_plan_t;
+
+/*
+ * Serve the plans on the Unix socket p_sock_path until killed. A client
+ * sends one line
+ *   flash <uart_device> <plan> [--rate n] [--flash-rate n] [--window n]
+ *         [--skip-unchanged] [--delta] [--chip-erase [auto]] [--compress]
+ * or
+ *   plans
+ * and reads back one line per step ("step <name>") then the result,
+ * "ok <seconds>" or "fail <code> <seconds> <step>", or "error <why>".
+ */
+int daemon_run(const char *p_sock_path, const daemon_plan_t *p_plans, uint32_t n_plans);
+
+#endif /* _DAEMON_H */
@@ -0,0 +1,190 @@
+/*
+ * sector granular delta between an image and the device flash
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "comm.h"
+#include "crypto.h"
+#include "delta.h"
+#include "session.h"
+
+/* below this number of sectors, ask for each sector instead of halves */
+#define DELTA_LEAF_SECTORS      4
+
+typedef struct {
+    bl602_session_t *p_ses;
+    const uint8_t *p_data;
+    uint32_t size;
+    uint32_t dst;
+    uint32_t base;              /* dst rounded down to the sector */
+    uint32_t sector_size;
+    bool *p_dirty;
+    uint32_t queries;
+    uint32_t max_queries;       /* past this, a differing run is taken as is */
+} delta_ctx_t;
+
+/* the part of the image in sectors [first, first + count) */
+static void delta_range(delta_ctx_t *p_ctx, uint32_t first, uint32_t count,
+        uint32_t *p_addr, uint32_t *p_len) {
+    uint32_t start = p_ctx->base + first * p_ctx->sector_size;
+    uint32_t end = start + count * p_ctx->sector_size;
+
+    if (start < p_ctx->dst) {
+        start = p_ctx->dst;
+    }
+    if (end > p_ctx->dst + p_ctx->size) {
+        end = p_ctx->dst + p_ctx->size;
+    }
+    *p_addr = start;
+    *p_len = end - start;
+}
+
+/*
+ * Hash a run of sectors on both sides, and only look closer if they
+ * differ: halves for long runs, single sectors for short ones. If the
+ * first half matches, the second one must be the culprit, so its own
+ * query is saved (known_dirty).
+ */
+static int delta_scan(delta_ctx_t *p_ctx, uint32_t first, uint32_t count, bool known_dirty) {
+    int ret_code = 0;
+    uint32_t addr = 0;
+    uint32_t len = 0;
+    uint32_t host_sha[8];
+    uint32_t dev_sha[8];
+    uint32_t half = 0;
+    uint32_t i = 0;
+    bool left_dirty = false;
+
+    if (!known_dirty) {
+        delta_range(p_ctx, first, count, &addr, &len);
+        calc_sha256(p_ctx->p_data + (addr - p_ctx->dst), len, host_sha);
+        ret_code = request_sha256(p_ctx->p_ses, addr, len, dev_sha);
+        p_ctx->queries++;
+        if (ret_code != 0) {
+            return ret_code;
+        }
+        if (memcmp(host_sha, dev_sha, sizeof host_sha) == 0) {
+            return 0;
+        }
+    }
+    /*
+     * a query is much cheaper than programming a sector, but a device
+     * which differs everywhere (e.g. blank) would cost more queries than
+     * sectors otherwise
+     */
+    if (count == 1 || p_ctx->queries >= p_ctx->max_queries) {
+        for (i = first; i < first + count; i++) {
+            p_ctx->p_dirty[i] = true;
+        }
+        return 0;
+    }
+    if (count <= DELTA_LEAF_SECTORS) {
+        for (i = 0; i < count && ret_code == 0; i++) {
+            ret_code = delta_scan(p_ctx, first + i, 1, false);
+        }
+        return ret_code;
+    }
+
+    half = count / 2;
+    ret_code = delta_scan(p_ctx, first, half, false);
+    if (ret_code != 0) {
+        return ret_code;
+    }
+    for (i = first; i < first + half; i++) {
+        left_dirty = left_dirty || p_ctx->p_dirty[i];
+    }
+
+    return delta_scan(p_ctx, first + half, count - half, !left_dirty);
+}
+
+int delta_plan(bl602_session_t *p_ses, const uint8_t *p_data, uint32_t size, uint32_t dst,
+        uint32_t sector_size, flash_run_t **pp_runs, uint32_t *p_n_runs) {
+    int ret_code = 0;
+    delta_ctx_t ctx;
+    flash_run_t *p_runs = NULL;
+    uint32_t n_sectors = 0;
+    uint32_t n_runs = 0;
+    uint32_t n_dirty = 0;
+    uint32_t addr = 0;
+    uint32_t len = 0;
+    uint32_t i = 0;
+
+    *pp_runs = NULL;
+    *p_n_runs = 0;
+    if (size == 0) {
+        return 0;
+    }
+    if (sector_size == 0) {
+        return -1;
+    }
+    memset(&ctx, 0, sizeof ctx);
+    ctx.p_ses = p_ses;
+    ctx.p_data = p_data;
+    ctx.size = size;
+    ctx.dst = dst;
+    ctx.base = dst - dst % sector_size;
+    ctx.sector_size = sector_size;
+    n_sectors = (dst + size - ctx.base + sector_size - 1) / sector_size;
+    ctx.max_queries = n_sectors;
+
+    ctx.p_dirty = calloc(n_sectors, sizeof(bool));
+    p_runs = malloc(n_sectors * sizeof(flash_run_t));
+    if (ctx.p_dirty == NULL || p_runs == NULL) {
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: malloc fail for the delta of 0x%08x\n", dst);
+        ret_code = -2;
+        goto fail;
+    }
+
+    ret_code = delta_scan(&ctx, 0, n_sectors, false);
+    if (ret_code != 0) {
+        goto fail;
+    }
+
+    /* merge the dirty sectors next to each other */
+    for (i = 0; i < n_sectors; i++) {
+        if (!ctx.p_dirty[i]) {
+            continue;
+        }
+        n_dirty++;
+        delta_range(&ctx, i, 1, &addr, &len);
+        if (n_runs > 0 && p_runs[n_runs - 1].addr + p_runs[n_runs - 1].len == addr) {
+            p_runs[n_runs - 1].len += len;
+        } else {
+            p_runs[n_runs].addr = addr;
+            p_runs[n_runs].len = len;
+            n_runs++;
+        }
+    }
+    flash_log(p_ses, BL602_LOG_INFO,
+            "delta: %u sector(s) of %u differ, %u run(s), %u queries\n", n_dirty, n_sectors,
+            n_runs, ctx.queries);
+
+    *pp_runs = p_runs;
+    *p_n_runs = n_runs;
+    p_runs = NULL;
+
+fail:
+    free(p_runs);
+    free(ctx.p_dirty);
+    return ret_code;
+}
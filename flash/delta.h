@@ -0,0 +1,38 @@
+/*
+ * sector granular delta between an image and the device flash
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _DELTA_H
+#define _DELTA_H
+
+#include <stdint.h>
+
+#include "plan.h"
+#include "bl602flash.h"
+
+/*
+ * Compare the image to be placed at dst against the device, sector by
+ * sector, through the SHA256 command of the eflash loader. The runs of
+ * sectors which differ are returned in *pp_runs (allocated, in address
+ * order, clipped to the image), *p_n_runs is 0 if the device already
+ * holds the image.
+ */
+int delta_plan(bl602_session_t *p_ses, const uint8_t *p_data, uint32_t size, uint32_t dst,
+        uint32_t sector_size, flash_run_t **pp_runs, uint32_t *p_n_runs);
+
+#endif /* _DELTA_H */
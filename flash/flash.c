@@ -20,70 +20,261 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <string.h>
 
 #include "uart.h"
 #include "comm.h"
+#include "pacing.h"
+#include "image.h"
+#include "delta.h"
+#include "compress.h"
+#include "pktsize.h"
+#include "ptable.h"
+#include "bundle.h"
+#include "bl602flash.h"
+#include "daemon.h"
 #include "crypto.h"
 #include "common_share.h"
 #include "packet_comm.h"
 
-int boot_rom_stage = 1;
+/* one board */
+typedef struct {
+    const char *p_uart_port;
+    bl602_session_t *p_ses;
+} flash_port_t;
 
 void print_help(const char *p_app_name)
 {
-    printf("USAGE: %s --uart uart_device --rate baud_rate --partition part1.bin part2.bin"
+    printf("USAGE: %s --uart uart_device [uart_device ...] --rate baud_rate --partition part1.bin part2.bin"
             "  --fw firmware.bin --dtb ro_param.dtb --eflash eflash_loader"
-            "  --boot2 boot2image.bin\n", p_app_name);
+            "  --boot2 boot2image.bin [--flash-rate max_baud_rate] [--window packets]"
+            "  [--skip-unchanged] [--delta] [--chip-erase [auto]] [--compress]\n"
+            "       %s --uart uart_device [uart_device ...] --rate baud_rate --bundle file.bundle"
+            "  [options]\n"
+            "       %s --make-bundle file.bundle --partition ... --boot2 boot2image.bin\n"
+            "       %s --daemon socket_path --plan name=file.bundle [--plan ...] [options]\n",
+            p_app_name, p_app_name, p_app_name, p_app_name);
     return;
 }
 
+/*
+ * Where the image goes: the active slot of its entry in the partition
+ * table if it has one, what its name says (partition.bin@0xe000, as
+ * partition_gen names them) otherwise, or where it was put already.
+ */
+static int place_job(flash_job_t *p_job, const char *p_part_name,
+        const pt_table_stuff_config_t *p_table)
+{
+    const char *p_at = strstr(p_job->p_name, "@0x");
+    uint32_t max_len = 0;
+    int ret_code = 0;
+
+    if (p_part_name == NULL) {
+        if (p_at != NULL) {
+            p_job->dst = strtoul(p_at + 1, NULL, 16);
+        }
+        if (p_job->dst == DST_NONE) {
+            fprintf(stderr, "ERROR: no address for %s, name it %s@0x<address>\n",
+                    p_job->p_name, p_job->p_name);
+            return -1;
+        }
+        return 0;
+    }
+
+    ret_code = ptable_find(p_table, p_part_name, &p_job->dst, &max_len);
+    if (ret_code != 0) {
+        return ret_code;
+    }
+    /* not fatal, as the partition after it may well be free */
+    if (p_job->image.size > max_len) {
+        fprintf(stderr, "WARNING: %s (%u bytes) is larger than partition %s (%u bytes)\n",
+                p_job->p_name, p_job->image.size, p_part_name, max_len);
+    }
+
+    return 0;
+}
+
+/*
+ * What a board gets at most, without asking it: skipped or delta images
+ * only take less. The time is the worst case of the erases plus the
+ * images on the wire at the rate asked for.
+ */
+static void print_plan(const flash_config_t *p_cfg)
+{
+    flash_geometry_t geom;
+    flash_run_t *p_runs = NULL;
+    uint32_t n_runs = 0;
+    uint32_t runs_cap = 0;
+    flash_run_t *p_erase = NULL;
+    uint32_t n_erase = 0;
+    uint32_t rate = (p_cfg->flash_rate > p_cfg->baud_rate) ? p_cfg->flash_rate
+        : p_cfg->baud_rate;
+    uint64_t bytes = 0;
+    uint64_t erase_ms = 0;
+    uint32_t packets = 0;
+    pktsize_t pkt;
+    uint32_t i = 0;
+
+    plan_geometry(&p_cfg->eflash_loader, &geom);
+    /* the sizes found before with the loader, or the defaults */
+    pktsize_init(&pkt, p_cfg->loader_sha256);
+    for (i = 0; i < p_cfg->n_jobs; i++) {
+        const flash_job_t *p_job = &p_cfg->jobs[i];
+
+        if (plan_add_run(&p_runs, &n_runs, &runs_cap, p_job->dst, p_job->image.size) != 0) {
+            goto fail;
+        }
+        bytes += p_job->image.size;
+        packets += (p_job->image.size + pkt.flash_payload - 1) / pkt.flash_payload;
+        fprintf(stdout, "plan: %s to [0x%08x, 0x%08x)\n", p_job->p_name, p_job->dst,
+                p_job->dst + p_job->image.size);
+    }
+    if (plan_erase(&geom, p_runs, n_runs, &p_erase, &n_erase) != 0) {
+        goto fail;
+    }
+    for (i = 0; i < n_erase; i++) {
+        erase_ms += plan_erase_time_ms(&geom, p_erase[i].addr, p_erase[i].len);
+        fprintf(stdout, "plan: erase [0x%08x, 0x%08x]\n", p_erase[i].addr,
+                p_erase[i].addr + p_erase[i].len - 1);
+    }
+    fprintf(stdout, "plan: %llu bytes in %u packets, up to %.1f s at %u baud\n\n",
+            (unsigned long long)bytes, packets,
+            erase_ms / 1000.0 + (p_cfg->eflash_loader.size * 10.0) / p_cfg->baud_rate
+            + (bytes * 10.0) / rate, rate);
+
+fail:
+    free(p_erase);
+    free(p_runs);
+}
+
+/* the loader and the images as they are placed, hashes included */
+static int make_bundle(const flash_config_t *p_cfg, const char *p_path)
+{
+    bundle_item_t items[BUNDLE_ENTRIES_MAX];
+    uint32_t n_items = 0;
+    uint32_t i = 0;
+    int ret_code = 0;
+
+    items[n_items].type = BUNDLE_LOADER;
+    items[n_items].dst = 0;
+    items[n_items].p_image = &p_cfg->eflash_loader;
+    items[n_items].p_sha256 = p_cfg->loader_sha256;
+    items[n_items].p_name = "eflash_loader";
+    n_items++;
+    for (i = 0; i < p_cfg->n_jobs && n_items < ARRAY_SIZE(items); i++) {
+        items[n_items].type = BUNDLE_IMAGE;
+        items[n_items].dst = p_cfg->jobs[i].dst;
+        items[n_items].p_image = &p_cfg->jobs[i].image;
+        items[n_items].p_sha256 = p_cfg->jobs[i].sha_256;
+        items[n_items].p_name = p_cfg->jobs[i].p_name;
+        n_items++;
+    }
+    ret_code = bundle_write(p_path, items, n_items);
+    if (ret_code == 0) {
+        fprintf(stdout, "SUCCEED: bundle %s written\n", p_path);
+    }
+
+    return ret_code;
+}
+
 /*
  * The usage
- * ./flash --uart uart_device --rate baud_rate --partition part1.bin part2.bin
+ * ./flash --uart uart_device [uart_device ...] --rate baud_rate
+ *   --partition part1.bin part2.bin
  *   --fw firmware.bin --dtb ro_param.dtb --eflash eflash_loader.bin
- *   --boot2 boot2image.bin
+ *   --boot2 boot2image.bin [--flash-rate max_baud_rate] [--window packets]
+ *   [--skip-unchanged] [--delta] [--chip-erase [auto]] [--compress]
+ * ./flash --uart uart_device [uart_device ...] --rate baud_rate --bundle file.bundle
+ *   [options]
+ * ./flash --make-bundle file.bundle --partition ... --boot2 boot2image.bin
+ * ./flash --daemon socket_path --plan name=file.bundle [--plan ...] [options]
+ *
+ * --make-bundle writes the loader and the images, placed and hashed, into
+ * one file instead of flashing, and --bundle flashes from such a file in
+ * place of --partition, --fw, --dtb, --eflash and --boot2.
+ * --daemon maps the bundles of the plans once and flashes the boards the
+ * clients of the Unix socket ask for (see daemon.h), the options are the
+ * defaults of the jobs.
+ *
+ * With several UART devices, the boards are flashed at the same time,
+ * all the ports driven by one epoll loop, from the same images in memory. A board which
+ * fails does not hold up the others, the result of each port is listed
+ * at the end.
+ * --rate is used with bootrom. With --flash-rate, the eflash loader is
+ * driven at the highest rate, up to max_baud_rate, which passes the
+ * hand shake and a probe.
+ * --window is the number of flash data packets sent ahead of their acks,
+ * 1 (the default) waits for each ack.
+ * --skip-unchanged asks the device for the SHA256 of the target range
+ * first, and leaves the image alone if it is already there.
+ * --delta goes down to the sectors: only the sectors whose SHA256 on the
+ * device differs from the image are erased and programmed.
+ * --chip-erase erases the whole flash at once, then programs the images
+ * back to back. With auto, it is done only if the planned erases cover
+ * at least 90% of the flash (its size from the JEDEC id), and would take
+ * longer (worst case from the flash config) than the chip erase.
+ * Either way, whatever is outside the images is lost.
+ * --compress sends xz streams for the loader to decompress, for the
+ * images written whole where this is faster at the link rate than the
+ * raw data. The images are compressed once, before any board is touched.
  */
 int main(int argc, char *argv[])
 {
     int ret_code = 0;
-    int uart_fd = -1;
-    uint32_t baud_rate = 230400;
-    boot_info_t boot_info;
+    static flash_config_t cfg;
+    static flash_port_t ports[FLASH_PORTS_MAX];
+    uint32_t n_ports = 0;
+    uint32_t n_failed = 0;
+    bl602_loop_t *p_loop = NULL;
+    int port_ret = 0;
+    bl602_stats_t stats;
     int i = 1;
     int j = 0;
-    char *p_uart_port = NULL;
     char *fw_file = NULL;
     char *dtb_file = NULL;
     char *boot2_file = NULL;
     char *p_part[4] = {NULL, NULL, NULL, NULL};
     char *eflash_loader_file = NULL;
+    char *p_bundle_file = NULL;
+    char *p_make_bundle = NULL;
+    char *p_daemon = NULL;
+    static daemon_plan_t plans[DAEMON_PLANS_MAX];
+    char *p_plan_files[DAEMON_PLANS_MAX];
+    uint32_t n_plans = 0;
+    pt_table_stuff_config_t ptable;
     /*
      * for looping, build the list of files to be flashed
      * fw + dtb + boot2 + the maximum number of partitions
-     * TODO: no hardcode! get the dst address from partition!!
+     * the fw and dtb go to their entries in the partition table
      */
     struct {
         uint32_t dst;
+        const char *p_part_name;
         char *p_file_name;
     } p_file_list[4 + 3] = {
-        {0x10000, NULL}, /* fw image */
-        {0x1F8000, NULL}, /* dtb */
-        {0x00000, NULL}, /* boot2 image */
-        {0xE000, NULL}, /* partition_0 */
-        {0xF000, NULL}, /* partition_1 */
-        {0x0000, NULL}, /* partition_2 */
-        {0x0000, NULL}, /* partition_3 */
+        {DST_NONE, "FW", NULL}, /* fw image */
+        {DST_NONE, "factory", NULL}, /* dtb */
+        {0x00000, NULL, NULL}, /* boot2 image */
+        {BFLB_PT_TABLE0_ADDRESS, NULL, NULL}, /* partition_0 */
+        {BFLB_PT_TABLE1_ADDRESS, NULL, NULL}, /* partition_1 */
+        {DST_NONE, NULL, NULL}, /* partition_2 */
+        {DST_NONE, NULL, NULL}, /* partition_3 */
     };
 
-    if (argc < 11) {
+    if (argc < 5) {
         fprintf(stderr, "ERROR: missing operand\n");
         print_help(argv[0]);
         return -1;
     }
 
+    memset(&cfg, 0, sizeof cfg);
+    cfg.baud_rate = 230400;
+    cfg.window = 1;
+    cfg.chip_erase = CHIP_ERASE_OFF;
+
     i = 1;
 #define CHECK_BOUND {\
     if (++i >= argc || (argv[i][0] == '-' && argv[i][1] == '-')) { \
@@ -95,10 +286,41 @@ int main(int argc, char *argv[])
     while (i < argc) {
         if (strcmp(argv[i], "--uart") == 0) {
             CHECK_BOUND;
-            p_uart_port = argv[i++];
+            while (i < argc && argv[i][0] != '-') {
+                if (n_ports == ARRAY_SIZE(ports)) {
+                    fprintf(stderr, "ERROR: at most %d UART devices\n", FLASH_PORTS_MAX);
+                    return -2;
+                }
+                ports[n_ports++].p_uart_port = argv[i++];
+            }
         } else if (strcmp(argv[i], "--rate") == 0) {
             CHECK_BOUND;
-            baud_rate = atoi(argv[i++]);
+            cfg.baud_rate = atoi(argv[i++]);
+        } else if (strcmp(argv[i], "--flash-rate") == 0) {
+            CHECK_BOUND;
+            cfg.flash_rate = atoi(argv[i++]);
+        } else if (strcmp(argv[i], "--skip-unchanged") == 0) {
+            cfg.skip_unchanged = true;
+            i++;
+        } else if (strcmp(argv[i], "--chip-erase") == 0) {
+            cfg.chip_erase = CHIP_ERASE_ON;
+            if (++i < argc && strcmp(argv[i], "auto") == 0) {
+                cfg.chip_erase = CHIP_ERASE_AUTO;
+                i++;
+            }
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            cfg.compress = true;
+            i++;
+        } else if (strcmp(argv[i], "--delta") == 0) {
+            cfg.delta = true;
+            i++;
+        } else if (strcmp(argv[i], "--window") == 0) {
+            CHECK_BOUND;
+            cfg.window = atoi(argv[i++]);
+            if (cfg.window < 1 || cfg.window > FLASH_WINDOW_MAX) {
+                fprintf(stderr, "ERROR: window should be 1 ~ %d\n", FLASH_WINDOW_MAX);
+                return -2;
+            }
         } else if (strcmp(argv[i], "--fw") == 0) {
             CHECK_BOUND;
             fw_file = argv[i++];
@@ -107,6 +329,28 @@ int main(int argc, char *argv[])
             CHECK_BOUND;
             boot2_file = argv[i++];
             p_file_list[2].p_file_name = boot2_file;
+        } else if (strcmp(argv[i], "--bundle") == 0) {
+            CHECK_BOUND;
+            p_bundle_file = argv[i++];
+        } else if (strcmp(argv[i], "--make-bundle") == 0) {
+            CHECK_BOUND;
+            p_make_bundle = argv[i++];
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            CHECK_BOUND;
+            p_daemon = argv[i++];
+        } else if (strcmp(argv[i], "--plan") == 0) {
+            CHECK_BOUND;
+            if (n_plans == ARRAY_SIZE(plans) || strchr(argv[i], '=') == NULL) {
+                fprintf(stderr, "ERROR: at most %d plans, as name=file.bundle\n",
+                        DAEMON_PLANS_MAX);
+                return -2;
+            }
+            /* name=file.bundle */
+            plans[n_plans].p_name = argv[i];
+            p_plan_files[n_plans] = strchr(argv[i], '=') + 1;
+            p_plan_files[n_plans][-1] = '\0';
+            n_plans++;
+            i++;
         } else if (strcmp(argv[i], "--eflash") == 0) {
             CHECK_BOUND;
             eflash_loader_file = argv[i++];
@@ -129,156 +373,172 @@ int main(int argc, char *argv[])
             return -2;
         }
     }
+    if (p_daemon != NULL) {
+        if (n_plans == 0) {
+            fprintf(stderr, "ERROR: missing --plan for the daemon\n");
+            goto fail2;
+        }
+        /* the options given here are the defaults of every plan */
+        for (j = 0; j < n_plans; j++) {
+            plans[j].cfg = cfg;
+            ret_code = load_bundle(&plans[j].cfg, p_plan_files[j]);
+            if (ret_code != 0) {
+                goto fail3;
+            }
+            /* any job may ask for --compress, the plan is compressed once for all */
+            ret_code = compress_jobs(&plans[j].cfg);
+            if (ret_code != 0) {
+                goto fail3;
+            }
+            printf("plan %s:\n", plans[j].p_name);
+            print_plan(&plans[j].cfg);
+        }
+        ret_code = daemon_run(p_daemon, plans, n_plans);
+        goto fail3;
+    }
+    if (p_bundle_file != NULL) {
+        if (n_ports == 0) {
+            fprintf(stderr, "ERROR: missing arguments for flashing\n");
+            goto fail2;
+        }
+        ret_code = load_bundle(&cfg, p_bundle_file);
+        if (ret_code != 0) {
+            goto fail;
+        }
+        goto plan;
+    }
+
     /* check arguments */
-    if (p_uart_port == NULL || dtb_file == NULL || fw_file == NULL
+    if ((n_ports == 0 && p_make_bundle == NULL) || dtb_file == NULL || fw_file == NULL
             || p_part[0] == NULL || eflash_loader_file == NULL
             || boot2_file == NULL) {
         fprintf(stderr, "ERROR: missing arguments for flashing\n");
         goto fail2;
     }
 
-    uart_fd = uart_open(p_uart_port, baud_rate);
-    if (uart_fd < 0) {
-        fprintf(stderr, "ERROR: failed to open UART\n");
-        return -2;
-    }
-
-#define CHECK_ERROR(ret_code)  {\
-    if (0 != (ret_code)) {      \
-        goto fail;              \
-    }                           \
-}
-    ret_code = hand_shake(uart_fd, baud_rate);
-    CHECK_ERROR(ret_code);
-
-    /* connection is established now */
-    (void) usleep(20 * 1000);
-    /* read_boot_info */
-    ret_code = request_boot_info(uart_fd, &boot_info);
-    CHECK_ERROR(ret_code);
-    /*
-     * Before flashing the images, eflash image has to program to device. eflash is the
-     * program executed on device to handle all flash operations, including erase, program,
-     * etc.
-     *
-     * Though the protocol doc says eflash is not signed and encrypted in Chapter 2, the
-     * below source code is still programed based on protocol in Chapter 1 for completenecess.
-     *
-     * Also note: this boot header might be different from the one generated from
-     * efuse_bootheader_cfg.conf, just in case you are curious.
-     */
-    /* load_boot_header */
-    (void) usleep(20 * 1000);
-    ret_code = load_boot_header(uart_fd, eflash_loader_file);
-    CHECK_ERROR(ret_code);
-
-    if (boot_info.sign != 0) {
-        /* if signed, load_public_key */
-        (void) usleep(20 * 1000);
-        ret_code = load_pub_key(uart_fd);
-        CHECK_ERROR(ret_code);
-
-        /* if signed, load signature */
-        (void) usleep(20 * 1000);
-        ret_code = load_signature(uart_fd);
-        CHECK_ERROR(ret_code);
-    }
-
-    if (boot_info.encrypted) {
-        /* if encrypted, load AES IV */
-        (void) usleep(20 * 1000);
-        ret_code = load_aes_iv(uart_fd);
-        CHECK_ERROR(ret_code);
+    /* the loader is sent in pieces, map it once for all of them */
+    ret_code = image_open(eflash_loader_file, &cfg.eflash_loader);
+    if (ret_code != 0) {
+        fprintf(stderr, "ERROR: failed to read eflash loader\n");
+        goto fail2;
     }
+    calc_sha256(cfg.eflash_loader.p_data, cfg.eflash_loader.size, cfg.loader_sha256);
 
-    /* load segment header */
-    (void) usleep(20 * 1000);
-    ret_code = load_segment_header(uart_fd, eflash_loader_file);
-    CHECK_ERROR(ret_code);
-
-    /* load segment data */
-    (void) usleep(20 * 1000);
-    ret_code = load_segment_data(uart_fd, eflash_loader_file);
-    CHECK_ERROR(ret_code);
+    /* map and hash the images once, all the ports share them */
+    for (cfg.n_jobs = 0; cfg.n_jobs < ARRAY_SIZE(p_file_list); cfg.n_jobs++) {
+        flash_job_t *p_job = &cfg.jobs[cfg.n_jobs];
 
-    /* check image */
-    (void) usleep(20 * 1000);
-    ret_code = check_image(uart_fd);
-    CHECK_ERROR(ret_code);
-
-    /* run image */
-    (void) usleep(20 * 1000);
-    ret_code = run_image(uart_fd);
-    CHECK_ERROR(ret_code);
-    /*
-     * At this point, the eflash image should be running, and ready to serve the flashing
-     * jobs. Shake hands to make sure it is OK.
-     */
-    (void) usleep(20 * 1000);
-    ret_code = hand_shake(uart_fd, baud_rate);
-    CHECK_ERROR(ret_code);
-
-#define CHECK_ERROR_P(ret_code)  {\
-    if (0 != (ret_code)) {      \
-        goto error_p;           \
-    }                           \
-}
-
-    boot_rom_stage = 0; /* flash stage */
-    for (i = 0; i < ARRAY_SIZE(p_file_list) && ret_code == 0; i++) {
-        uint8_t *p_buf = NULL;
-        uint32_t sha_256[8] = {0};
-        uint32_t sz_curr = 0;
-
-        if (p_file_list[i].p_file_name == NULL) {
+        if (p_file_list[cfg.n_jobs].p_file_name == NULL) {
 #ifdef DEBUG
             printf("WARNING: the file name is empty \n");
 #endif
             break;
         }
-        fprintf(stdout, "flashing *** %s ***\n", p_file_list[i].p_file_name);
-        /* read_to_buf, allocate enough memory, and read file into the buf */
-        ret_code = read_to_buf(p_file_list[i].p_file_name, &p_buf, &sz_curr);
-        CHECK_ERROR_P(ret_code);
-
-        calc_sha256(p_buf, sz_curr, (uint32_t *)&sha_256[0]);
+        p_job->p_name = p_file_list[cfg.n_jobs].p_file_name;
+        p_job->dst = p_file_list[cfg.n_jobs].dst;
+        /* map the image, the pages are read in as they are flashed */
+        ret_code = image_open(p_job->p_name, &p_job->image);
+        if (ret_code != 0) {
+            goto fail;
+        }
+        calc_sha256(p_job->image.p_data, p_job->image.size, (uint32_t *)&p_job->sha_256[0]);
 #ifdef DEBUG
-        dump_hex("pre-calculate sha256", (uint8_t *)sha_256, sizeof sha_256);
+        dump_hex("pre-calculate sha256", (uint8_t *)p_job->sha_256, sizeof p_job->sha_256);
 #endif
-        (void) usleep(20 * 1000);
-        ret_code = erase_storage(uart_fd, p_file_list[i].dst, sz_curr);
-        CHECK_ERROR_P(ret_code);
+    }
 
-        (void) usleep(20 * 1000);
-        ret_code = flash_data(uart_fd, p_buf, sz_curr, p_file_list[i].dst);
-        CHECK_ERROR_P(ret_code);
+    /* where the images go, from the first partition table */
+    ret_code = ptable_load(&cfg.jobs[3].image, &ptable);
+    if (ret_code != 0) {
+        fprintf(stderr, "ERROR: invalid partition table %s\n", cfg.jobs[3].p_name);
+        goto fail;
+    }
+    for (j = 0; j < cfg.n_jobs; j++) {
+        ret_code = place_job(&cfg.jobs[j], p_file_list[j].p_part_name, &ptable);
+        if (ret_code != 0) {
+            goto fail;
+        }
+    }
 
-        (void) usleep(20 * 1000);
-        ret_code = notify_flash_done(uart_fd);
-        CHECK_ERROR_P(ret_code);
+plan:
+    /* the whole plan, before any board is touched */
+    print_plan(&cfg);
+    if (p_make_bundle != NULL) {
+        ret_code = make_bundle(&cfg, p_make_bundle);
+        goto fail;
+    }
+    if (cfg.compress) {
+        ret_code = compress_jobs(&cfg);
+        if (ret_code != 0) {
+            goto fail;
+        }
+    }
 
-        (void) usleep(20 * 1000);
-        ret_code = send_sha256(uart_fd, sha_256, p_file_list[i].dst, sz_curr);
-        CHECK_ERROR_P(ret_code);
+    for (i = 0; i < n_ports; i++) {
+        ports[i].p_ses = bl602_session_new(ports[i].p_uart_port, &cfg);
+        if (ports[i].p_ses == NULL) {
+            fprintf(stderr, "ERROR: malloc fail for the session of %s\n",
+                    ports[i].p_uart_port);
+            ret_code = -1;
+            goto fail;
+        }
+    }
+    if (n_ports == 1) {
+        ret_code = bl602_session_run(ports[0].p_ses);
+        goto fail;
+    }
 
-error_p:
-        free(p_buf);
-        p_buf = NULL;
+    /* one loop, on this thread, for all the boards */
+    p_loop = bl602_loop_new();
+    if (p_loop == NULL) {
+        fprintf(stderr, "ERROR: unable to create the loop of the ports\n");
+        ret_code = -3;
+        goto fail;
+    }
+    for (i = 0; i < n_ports; i++) {
+        (void) bl602_loop_add(p_loop, ports[i].p_ses);
     }
+    (void) bl602_loop_run(p_loop);
+    bl602_loop_free(p_loop);
 
-    if (ret_code == 0) {
-        ret_code = send_finish(uart_fd, 2000000);
-        if (ret_code == 0) {
-            fprintf(stderr, "SUCCEED: flash completed\n");
+    fprintf(stdout, "\n");
+    for (i = 0; i < n_ports; i++) {
+        bl602_session_stats(ports[i].p_ses, &stats);
+        port_ret = bl602_session_result(ports[i].p_ses);
+        if (port_ret == 0) {
+            fprintf(stdout, "SUCCEED: %s in %.1f s\n", ports[i].p_uart_port,
+                    stats.elapsed_us / 1e6);
         } else {
-            fprintf(stderr, "ERROR: re-hand shake fail\n");
+            fprintf(stdout, "FAIL: %s (%d) at %s after %.1f s\n", ports[i].p_uart_port,
+                    port_ret,
+                    (stats.p_failed_step != NULL) ? stats.p_failed_step : "start",
+                    stats.elapsed_us / 1e6);
+            n_failed++;
+            ret_code = port_ret;
         }
     }
+    fprintf(stdout, "%u of %u boards flashed\n", n_ports - n_failed, n_ports);
 
 fail:
-    /* Close UART */
-    uart_close(uart_fd);
+    for (i = 0; i < n_ports; i++) {
+        bl602_session_free(ports[i].p_ses);
+    }
+    free_jobs_xz(&cfg);
+    if (cfg.bundle.p_data == NULL) {
+        for (j = 0; j < ARRAY_SIZE(cfg.jobs); j++) {
+            image_close(&cfg.jobs[j].image);
+        }
+        image_close(&cfg.eflash_loader);
+    }
+    image_close(&cfg.bundle);
 
 fail2:
     return ret_code;
+
+fail3:
+    for (j = 0; j < n_plans; j++) {
+        free_jobs_xz(&plans[j].cfg);
+        image_close(&plans[j].cfg.bundle);
+    }
+    return ret_code;
 }
@@ -0,0 +1,100 @@
+/*
+ * flash BL 60x, the images and the options of a session
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _FLASH_H
+#define _FLASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "image.h"
+
+#define FLASH_PORTS_MAX     32
+
+enum {
+    CHIP_ERASE_OFF,
+    CHIP_ERASE_AUTO,        /* when it is faster than the planned erases */
+    CHIP_ERASE_ON,
+};
+
+/* one image to flash, mapped, hashed and compressed once for all the ports */
+typedef struct {
+    const char *p_name;
+    image_view_t image;
+    uint32_t dst;
+    uint32_t sha_256[8];
+    uint8_t *p_xz;                  /* the whole image as xz streams, if compressed */
+    uint32_t len_xz;
+} flash_job_t;
+
+/* what all the ports do, read only once the ports are started */
+typedef struct {
+    uint32_t baud_rate;
+    uint32_t flash_rate;
+    uint32_t window;
+    bool skip_unchanged;
+    bool delta;
+    bool compress;
+    int chip_erase;
+    image_view_t bundle;            /* the files below are views into it, if any */
+    image_view_t eflash_loader;
+    uint32_t loader_sha256[8];
+    flash_job_t jobs[4 + 3];
+    uint32_t n_jobs;
+} flash_config_t;
+
+/* the image has no address yet */
+#define DST_NONE            UINT32_MAX
+
+/*
+ * The steps of a session with a board. The bootrom takes the eflash
+ * loader, then the loader takes the images: one erase pass over all of
+ * them, and for each image program, done and the SHA256 check.
+ */
+typedef enum {
+    FS_HAND_SHAKE,
+    FS_BOOT_INFO,
+    FS_BOOT_HEADER,
+    FS_PUB_KEY,
+    FS_SIGNATURE,
+    FS_AES_IV,
+    FS_SEGMENT_HEADER,
+    FS_SEGMENT_DATA,
+    FS_CHECK_IMAGE,
+    FS_RUN_IMAGE,
+    FS_LOADER_HAND_SHAKE,
+    FS_PLAN,
+    FS_ERASE,
+    FS_PROGRAM,
+    FS_PROGRAM_DONE,
+    FS_VERIFY,
+    FS_FINISH,
+    FS_DONE,
+} flash_state_t;
+
+const char *flash_state_name(flash_state_t state);
+
+/* map the bundle, the loader and the images of p_cfg are views into it */
+int load_bundle(flash_config_t *p_cfg, const char *p_path);
+
+/* xz the images of p_cfg before the sessions start, they share the result */
+int compress_jobs(flash_config_t *p_cfg);
+void free_jobs_xz(flash_config_t *p_cfg);
+
+#endif /* _FLASH_H */
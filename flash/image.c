@@ -0,0 +1,136 @@
+/*
+ * image source for flashing
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "image.h"
+#include "session.h"
+
+/*
+ * read file into a allocated buffer, the file might be a pipe
+ * whose size is not known in advance
+ */
+int read_to_buf(const char *p_file_name, uint8_t **p_buf, uint32_t *p_sz_data) {
+    int ret_code = 0;
+    uint8_t *p_local = NULL;
+    size_t cap = 64 * 1024;
+    size_t len = 0;
+    size_t items_n = 0;
+    FILE *f = NULL;
+
+    if (p_file_name == NULL) {
+        return -1;
+    }
+    f = fopen(p_file_name, "r");
+    if (f == NULL) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: fail to open %s\n", p_file_name);
+        return -4;
+    }
+    p_local = (uint8_t *)malloc(cap);
+    if (p_local == NULL) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: malloc fail for '%s'", p_file_name);
+        ret_code = -3;
+        goto fail;
+    }
+    while ((items_n = fread(p_local + len, 1, cap - len, f)) > 0) {
+        len += items_n;
+        if (len == cap) {
+            uint8_t *p_new = realloc(p_local, cap * 2);
+
+            if (p_new == NULL) {
+                flash_log(NULL, BL602_LOG_ERROR, "ERROR: malloc fail for '%s'", p_file_name);
+                ret_code = -3;
+                goto fail;
+            }
+            p_local = p_new;
+            cap = cap * 2;
+        }
+    }
+    if (ferror(f)) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: incorrect items read\n");
+        ret_code = -5;
+        goto fail;
+    }
+
+    *p_buf = p_local;
+    *p_sz_data = len;
+    p_local = NULL;
+
+fail:
+    free(p_local);
+    fclose(f);
+    return ret_code;
+}
+
+int image_open(const char *p_file_name, image_view_t *p_view) {
+    int fd = -1;
+    struct stat f_stat;
+    void *p_map = NULL;
+
+    memset(p_view, 0, sizeof(*p_view));
+    if (p_file_name == NULL) {
+        return -1;
+    }
+    fd = open(p_file_name, O_RDONLY);
+    if (fd < 0) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: fail to open %s\n", p_file_name);
+        return -2;
+    }
+    if (fstat(fd, &f_stat) < 0) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: fail to get stats of '%s'\n", p_file_name);
+        close(fd);
+        return -2;
+    }
+    if (!S_ISREG(f_stat.st_mode) || f_stat.st_size == 0) {
+        /* no mapping for pipes, sockets, or empty files */
+        close(fd);
+        return read_to_buf(p_file_name, &p_view->p_data, &p_view->size);
+    }
+
+    p_map = mmap(NULL, f_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p_map == MAP_FAILED) {
+        return read_to_buf(p_file_name, &p_view->p_data, &p_view->size);
+    }
+    /* the image is consumed front to back */
+    (void) madvise(p_map, f_stat.st_size, MADV_SEQUENTIAL);
+
+    p_view->p_data = (uint8_t *)p_map;
+    p_view->size = f_stat.st_size;
+    p_view->mapped = true;
+
+    return 0;
+}
+
+void image_close(image_view_t *p_view) {
+    if (p_view->mapped) {
+        munmap(p_view->p_data, p_view->size);
+    } else {
+        free(p_view->p_data);
+    }
+    memset(p_view, 0, sizeof(*p_view));
+}
@@ -0,0 +1,44 @@
+/*
+ * image source for flashing
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * read-only view of an image file. Regular files are mapped, so all
+ * processes flashing the same image share the pages in page cache.
+ * Pipes and the like are read into a buffer.
+ */
+typedef struct {
+    uint8_t *p_data;
+    uint32_t size;
+    bool mapped;
+} image_view_t;
+
+int image_open(const char *p_file_name, image_view_t *p_view);
+
+void image_close(image_view_t *p_view);
+
+/* buffered fallback of image_open */
+int read_to_buf(const char *p_file_name, uint8_t **p_buf, uint32_t *p_sz_data);
+
+#endif /* _IMAGE_H */
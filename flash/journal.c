@@ -0,0 +1,185 @@
+/*
+ * journal of the flash data acked by the eflash loader, per port
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "crc32.h"
+#include "plan.h"
+#include "journal.h"
+
+static int extent_cmp(const void *p_a, const void *p_b)
+{
+    const journal_extent_t *p_x = p_a;
+    const journal_extent_t *p_y = p_b;
+
+    return (p_x->addr > p_y->addr) - (p_x->addr < p_y->addr);
+}
+
+static void journal_load(journal_t *p_jnl)
+{
+    journal_extent_t *p_new = NULL;
+    FILE *f = NULL;
+    unsigned int addr = 0;
+    unsigned int len = 0;
+    unsigned int crc = 0;
+
+    f = fopen(p_jnl->path, "r");
+    if (f == NULL) {
+        return;
+    }
+    while (fscanf(f, "%x %x %x", &addr, &len, &crc) == 3) {
+        if (p_jnl->n_extents == p_jnl->cap) {
+            p_new = realloc(p_jnl->p_extents, (p_jnl->cap + 64) * sizeof(*p_new));
+            if (p_new == NULL) {
+                break;
+            }
+            p_jnl->p_extents = p_new;
+            p_jnl->cap += 64;
+        }
+        p_jnl->p_extents[p_jnl->n_extents].addr = addr;
+        p_jnl->p_extents[p_jnl->n_extents].len = len;
+        p_jnl->p_extents[p_jnl->n_extents].crc32 = crc;
+        p_jnl->p_extents[p_jnl->n_extents].keep = false;
+        p_jnl->n_extents++;
+    }
+    fclose(f);
+    qsort(p_jnl->p_extents, p_jnl->n_extents, sizeof(journal_extent_t), extent_cmp);
+}
+
+void journal_init(journal_t *p_jnl, const char *p_uart_port)
+{
+    const char *p_home = getenv("HOME");
+    const char *p_base = NULL;
+
+    journal_end(p_jnl, false);
+    if (p_home == NULL || p_uart_port == NULL) {
+        return;
+    }
+    /* one file per port, named after the device node */
+    p_base = strrchr(p_uart_port, '/');
+    p_base = (p_base == NULL) ? p_uart_port : p_base + 1;
+    snprintf(p_jnl->path, sizeof p_jnl->path, "%s/.cache/bl602_flash/journal_%s",
+            p_home, p_base);
+    journal_load(p_jnl);
+}
+
+uint32_t journal_covered(const journal_t *p_jnl, const uint8_t *p_data, uint32_t len,
+        uint32_t addr)
+{
+    const journal_extent_t *p_ext = NULL;
+    uint32_t end = addr + len;
+    uint32_t cur = addr;
+    uint32_t i = 0;
+
+    for (i = 0; i < p_jnl->n_extents && cur < end; i++) {
+        p_ext = &p_jnl->p_extents[i];
+        if (p_ext->addr < cur || p_ext->addr + p_ext->len > end) {
+            continue;
+        }
+        /* runs of 0xFF are not sent, the erase took care of them */
+        if (p_ext->addr > cur && plan_sparse_bytes(p_data + (cur - addr), p_ext->addr - cur) != 0) {
+            break;
+        }
+        if (crc32_update(0, p_data + (p_ext->addr - addr), p_ext->len) != p_ext->crc32) {
+            break;
+        }
+        cur = p_ext->addr + p_ext->len;
+    }
+    if (cur > addr && cur < end && plan_sparse_bytes(p_data + (cur - addr), end - cur) == 0) {
+        cur = end;
+    }
+
+    return cur - addr;
+}
+
+void journal_keep(journal_t *p_jnl, uint32_t addr, uint32_t len)
+{
+    uint32_t i = 0;
+
+    for (i = 0; i < p_jnl->n_extents; i++) {
+        if (p_jnl->p_extents[i].addr >= addr
+                && p_jnl->p_extents[i].addr + p_jnl->p_extents[i].len <= addr + len) {
+            p_jnl->p_extents[i].keep = true;
+        }
+    }
+}
+
+int journal_begin(journal_t *p_jnl)
+{
+    char dir[PATH_MAX];
+    char *p_slash = NULL;
+    uint32_t i = 0;
+
+    if (p_jnl->path[0] == '\0') {
+        return 0;
+    }
+    /* create $HOME/.cache/bl602_flash if needed */
+    snprintf(dir, sizeof dir, "%s", p_jnl->path);
+    p_slash = strrchr(dir, '/');
+    *p_slash = '\0';
+    p_slash = strrchr(dir, '/');
+    *p_slash = '\0';
+    (void) mkdir(dir, 0755);
+    *p_slash = '/';
+    (void) mkdir(dir, 0755);
+
+    p_jnl->f = fopen(p_jnl->path, "w");
+    if (p_jnl->f == NULL) {
+        return -1;
+    }
+    for (i = 0; i < p_jnl->n_extents; i++) {
+        if (p_jnl->p_extents[i].keep) {
+            fprintf(p_jnl->f, "%08x %x %08x\n", p_jnl->p_extents[i].addr,
+                    p_jnl->p_extents[i].len, p_jnl->p_extents[i].crc32);
+        }
+    }
+    fflush(p_jnl->f);
+    p_jnl->n_extents = 0;
+
+    return 0;
+}
+
+void journal_acked(journal_t *p_jnl, uint32_t addr, uint32_t len, const uint8_t *p_data)
+{
+    if (p_jnl->f == NULL) {
+        return;
+    }
+    /* flushed, not synced: a cable glitch leaves the process alive */
+    fprintf(p_jnl->f, "%08x %x %08x\n", addr, len, crc32_update(0, p_data, len));
+    fflush(p_jnl->f);
+}
+
+void journal_end(journal_t *p_jnl, bool done)
+{
+    if (p_jnl->f != NULL) {
+        fclose(p_jnl->f);
+    }
+    if (done && p_jnl->path[0] != '\0') {
+        (void) unlink(p_jnl->path);
+    }
+    free(p_jnl->p_extents);
+    memset(p_jnl, 0, sizeof(*p_jnl));
+}
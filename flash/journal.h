@@ -0,0 +1,76 @@
+/*
+ * journal of the flash data acked by the eflash loader, per port
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+/*
+ * Each extent of flash data the loader acks is appended to
+ *      $HOME/.cache/bl602_flash/journal_<port>
+ * as "addr len crc32" of the data. A session which fails leaves it
+ * behind, the next session on the port takes the images up from where
+ * the journal and the device (asked for the SHA256) agree, instead of
+ * erasing and programming them all over again. A session which
+ * succeeds removes it.
+ */
+typedef struct {
+    uint32_t addr;
+    uint32_t len;
+    uint32_t crc32;
+    bool keep;
+} journal_extent_t;
+
+/* per session, each port has a journal of its own */
+typedef struct {
+    char path[PATH_MAX];
+    journal_extent_t *p_extents;    /* left by the sessions before, by address */
+    uint32_t n_extents;
+    uint32_t cap;
+    FILE *f;
+} journal_t;
+
+void journal_init(journal_t *p_jnl, const char *p_uart_port);
+
+/*
+ * how much of [addr, addr + len), from addr on, the journal holds with
+ * the same data as p_data; 0xFF between the extents counts as held
+ */
+uint32_t journal_covered(const journal_t *p_jnl, const uint8_t *p_data, uint32_t len,
+        uint32_t addr);
+
+/* the extents within [addr, addr + len) stay valid in this session */
+void journal_keep(journal_t *p_jnl, uint32_t addr, uint32_t len);
+
+/*
+ * start over with the kept extents only, the rest is to be erased;
+ * -1 if the file can not be written, nothing is journaled then
+ */
+int journal_begin(journal_t *p_jnl);
+
+void journal_acked(journal_t *p_jnl, uint32_t addr, uint32_t len, const uint8_t *p_data);
+
+/* done: the session succeeded, nothing to take up later */
+void journal_end(journal_t *p_jnl, bool done);
+
+#endif /* _JOURNAL_H */
@@ -0,0 +1,375 @@
+/*
+ * one thread, many sessions: the epoll loop driving them
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "uart.h"
+#include "loop.h"
+#include "session.h"
+
+#define LOOP_EVENTS_MAX     64
+
+/* epoll data of a session: its index, and whether it is its timer */
+#define LOOP_TAG(i, timer)  (((uint64_t)(i) << 1) | (timer))
+
+struct bl602_loop {
+    int epoll_fd;
+    bl602_session_t **pp_sessions;
+    uint32_t n_sessions;
+    uint32_t cap;
+    uint32_t n_running;
+    ucontext_t main_ctx;            /* the loop itself, between two sessions */
+};
+
+bl602_loop_t *bl602_loop_new(void)
+{
+    bl602_loop_t *p_loop = calloc(1, sizeof(*p_loop));
+
+    if (p_loop == NULL) {
+        return NULL;
+    }
+    p_loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (p_loop->epoll_fd < 0) {
+        free(p_loop);
+        return NULL;
+    }
+
+    return p_loop;
+}
+
+void bl602_loop_free(bl602_loop_t *p_loop)
+{
+    uint32_t i = 0;
+
+    if (p_loop == NULL) {
+        return;
+    }
+    for (i = 0; i < p_loop->n_sessions; i++) {
+        p_loop->pp_sessions[i]->io.p_loop = NULL;
+    }
+    close(p_loop->epoll_fd);
+    free(p_loop->pp_sessions);
+    free(p_loop);
+}
+
+int bl602_loop_add(bl602_loop_t *p_loop, bl602_session_t *p_ses)
+{
+    bl602_session_t **pp_new = NULL;
+
+    if (p_ses->io.p_loop != NULL) {
+        flash_log(p_ses, BL602_LOG_ERROR, "ERROR: %s is in a loop already\n",
+                p_ses->p_uart_port);
+        return -1;
+    }
+    if (p_loop->n_sessions == p_loop->cap) {
+        pp_new = realloc(p_loop->pp_sessions, (p_loop->cap + 8) * sizeof(*pp_new));
+        if (pp_new == NULL) {
+            flash_log(p_ses, BL602_LOG_ERROR, "ERROR: malloc fail for the loop\n");
+            return -2;
+        }
+        p_loop->pp_sessions = pp_new;
+        p_loop->cap += 8;
+    }
+    p_loop->pp_sessions[p_loop->n_sessions++] = p_ses;
+    memset(&p_ses->io, 0, sizeof p_ses->io);
+    p_ses->io.p_loop = p_loop;
+    p_ses->io.watched_fd = -1;
+    p_ses->io.timer_fd = -1;
+    p_ses->io.ret_code = -1;
+
+    return 0;
+}
+
+int bl602_session_result(const bl602_session_t *p_ses)
+{
+    return p_ses->io.ret_code;
+}
+
+/* out of a wait when not in a loop, e.g. a command sent on its own */
+static int block_wait(int fd, short events, uint64_t deadline)
+{
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    while (1) {
+        uint64_t now = mono_time_us();
+        int wait_ms;
+
+        if (deadline != 0 && now >= deadline) {
+            return 0;
+        }
+        /* round up, so it never spins with timeout of 0 */
+        wait_ms = (deadline == 0) ? -1 : (int)((deadline - now + 999) / 1000);
+        pfd.revents = 0;
+        ret = poll(&pfd, (events != 0) ? 1 : 0, wait_ms);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            continue;
+        }
+        /* a hung up tty reads 0 at once, it would spin until the deadline */
+        if (pfd.revents & (POLLERR | POLLNVAL | POLLHUP)) {
+            return -1;
+        }
+        return 1;
+    }
+}
+
+int session_wait_fd(bl602_session_t *p_ses, int fd, short events, uint64_t deadline)
+{
+    session_io_t *p_io = &p_ses->io;
+
+    /* nothing to wait for, or the deadline is past */
+    if ((events == 0 && deadline == 0) || (deadline != 0 && mono_time_us() >= deadline)) {
+        return 0;
+    }
+    if (p_io->p_loop == NULL || p_io->p_stack == NULL) {
+        return block_wait(fd, events, deadline);
+    }
+    p_io->wait_fd = fd;
+    p_io->events = events;
+    p_io->deadline = deadline;
+    p_io->ready = 0;
+    /* back to the loop, until the events or the deadline are there */
+    swapcontext(&p_io->ctx, &p_io->p_loop->main_ctx);
+    p_io->events = 0;
+    p_io->deadline = 0;
+    /*
+     * any other fd may be closed before the next wait and its number
+     * taken by a new one, which epoll would not know of
+     */
+    if (p_io->watched_fd >= 0 && p_io->watched_fd != p_ses->uart_fd) {
+        (void) epoll_ctl(p_io->p_loop->epoll_fd, EPOLL_CTL_DEL, p_io->watched_fd, NULL);
+        p_io->watched_fd = -1;
+    }
+
+    return p_io->ready;
+}
+
+int session_wait(bl602_session_t *p_ses, short events, uint64_t deadline)
+{
+    return session_wait_fd(p_ses, p_ses->uart_fd, events, deadline);
+}
+
+void session_sleep_until(bl602_session_t *p_ses, uint64_t deadline)
+{
+    (void) session_wait(p_ses, 0, deadline);
+}
+
+/* the stack of a session starts here, the pointer comes in two halves */
+static void session_main(uint32_t hi, uint32_t lo)
+{
+    bl602_session_t *p_ses = (bl602_session_t *)(((uintptr_t)hi << 16 << 16) | lo);
+
+    p_ses->io.ret_code = session_flash(p_ses);
+    p_ses->io.done = true;
+    /* uc_link takes it back to the loop */
+}
+
+/* what the session waits for next, on the fd and on its timer */
+static void session_watch(bl602_loop_t *p_loop, uint32_t i)
+{
+    session_io_t *p_io = &p_loop->pp_sessions[i]->io;
+    int wait_fd = p_io->wait_fd;
+    struct epoll_event ev;
+    struct itimerspec its;
+    uint32_t events = 0;
+
+    if (p_io->events & POLLIN) {
+        events |= EPOLLIN;
+    }
+    if (p_io->events & POLLOUT) {
+        events |= EPOLLOUT;
+    }
+    /* errors and hang up are reported whatever events, drop the fd if not waited for */
+    if (p_io->watched_fd >= 0 && (events == 0 || p_io->watched_fd != wait_fd)) {
+        (void) epoll_ctl(p_loop->epoll_fd, EPOLL_CTL_DEL, p_io->watched_fd, NULL);
+        p_io->watched_fd = -1;
+    }
+    if (events != 0 && (p_io->watched_fd < 0 || p_io->watched_events != events)) {
+        memset(&ev, 0, sizeof ev);
+        ev.events = events;
+        ev.data.u64 = LOOP_TAG(i, 0);
+        if (epoll_ctl(p_loop->epoll_fd, (p_io->watched_fd < 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                    wait_fd, &ev) == 0) {
+            p_io->watched_fd = wait_fd;
+            p_io->watched_events = events;
+        } else {
+            /* nothing to wait for on the fd, it fails at once */
+            p_io->ready = -1;
+            p_io->deadline = mono_time_us();
+        }
+    }
+
+    /* 0 disarms the timer */
+    memset(&its, 0, sizeof its);
+    its.it_value.tv_sec = p_io->deadline / 1000000;
+    its.it_value.tv_nsec = (p_io->deadline % 1000000) * 1000;
+    (void) timerfd_settime(p_io->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void session_end(bl602_loop_t *p_loop, bl602_session_t *p_ses)
+{
+    session_io_t *p_io = &p_ses->io;
+
+    /* the fd is closed by now, epoll dropped it with the close */
+    p_io->watched_fd = -1;
+    if (p_io->timer_fd >= 0) {
+        close(p_io->timer_fd);
+        p_io->timer_fd = -1;
+    }
+    if (p_io->p_stack != NULL) {
+        munmap(p_io->p_stack, LOOP_STACK_SIZE);
+        p_io->p_stack = NULL;
+    }
+    p_loop->n_running--;
+}
+
+/* run session i until it waits for something, or is done */
+static void session_resume(bl602_loop_t *p_loop, uint32_t i)
+{
+    bl602_session_t *p_ses = p_loop->pp_sessions[i];
+
+    swapcontext(&p_loop->main_ctx, &p_ses->io.ctx);
+    if (p_ses->io.done) {
+        session_end(p_loop, p_ses);
+    } else {
+        session_watch(p_loop, i);
+    }
+}
+
+/* a stack and a timer for session i, then its first steps */
+static void session_start(bl602_loop_t *p_loop, uint32_t i)
+{
+    bl602_session_t *p_ses = p_loop->pp_sessions[i];
+    session_io_t *p_io = &p_ses->io;
+    uintptr_t ptr = (uintptr_t)p_ses;
+    struct epoll_event ev;
+
+    p_loop->n_running++;
+    p_io->done = false;
+    p_io->p_stack = mmap(NULL, LOOP_STACK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (p_io->p_stack == MAP_FAILED) {
+        p_io->p_stack = NULL;
+        goto fail;
+    }
+    /* the stack grows down, an overflow faults on the lowest page */
+    (void) mprotect(p_io->p_stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+    p_io->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (p_io->timer_fd < 0) {
+        goto fail;
+    }
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.u64 = LOOP_TAG(i, 1);
+    if (epoll_ctl(p_loop->epoll_fd, EPOLL_CTL_ADD, p_io->timer_fd, &ev) != 0) {
+        goto fail;
+    }
+    getcontext(&p_io->ctx);
+    p_io->ctx.uc_stack.ss_sp = p_io->p_stack;
+    p_io->ctx.uc_stack.ss_size = LOOP_STACK_SIZE;
+    p_io->ctx.uc_link = &p_loop->main_ctx;
+    makecontext(&p_io->ctx, (void (*)(void))session_main, 2, (uint32_t)(ptr >> 16 >> 16),
+            (uint32_t)ptr);
+    session_resume(p_loop, i);
+    return;
+
+fail:
+    flash_log(p_ses, BL602_LOG_ERROR, "ERROR: unable to start the session of %s\n",
+            p_ses->p_uart_port);
+    p_io->ret_code = -1;
+    p_io->done = true;
+    session_end(p_loop, p_ses);
+}
+
+/*
+ * All the sessions run on this thread: each one runs until it waits,
+ * the loop sleeps in epoll_wait() until a UART has the events or a
+ * deadline is there, and resumes the session it is for.
+ */
+int bl602_loop_run(bl602_loop_t *p_loop)
+{
+    struct epoll_event evs[LOOP_EVENTS_MAX];
+    uint64_t expired = 0;
+    uint32_t n_failed = 0;
+    uint32_t i = 0;
+    int n = 0;
+    int e = 0;
+
+    for (i = 0; i < p_loop->n_sessions; i++) {
+        session_start(p_loop, i);
+    }
+    while (p_loop->n_running > 0) {
+        n = epoll_wait(p_loop->epoll_fd, evs, LOOP_EVENTS_MAX, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            flash_log(NULL, BL602_LOG_ERROR, "ERROR: epoll_wait: %s\n", strerror(errno));
+            return -1;
+        }
+        for (e = 0; e < n; e++) {
+            bl602_session_t *p_ses = p_loop->pp_sessions[evs[e].data.u64 >> 1];
+            session_io_t *p_io = &p_ses->io;
+
+            /* events of a batch may be stale once the session moved on */
+            if (p_io->done) {
+                continue;
+            }
+            if (evs[e].data.u64 & 1) {
+                (void) read(p_io->timer_fd, &expired, sizeof expired);
+                if (p_io->deadline == 0 || mono_time_us() < p_io->deadline) {
+                    continue;
+                }
+            } else {
+                if (p_io->events == 0) {
+                    continue;
+                }
+                p_io->ready = (evs[e].events & (EPOLLERR | EPOLLHUP)) ? -1 : 1;
+            }
+            session_resume(p_loop, evs[e].data.u64 >> 1);
+        }
+    }
+    for (i = 0; i < p_loop->n_sessions; i++) {
+        if (p_loop->pp_sessions[i]->io.ret_code != 0) {
+            n_failed++;
+        }
+    }
+
+    return n_failed;
+}
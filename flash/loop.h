@@ -0,0 +1,73 @@
+/*
+ * one thread, many sessions: the epoll loop driving them
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _LOOP_H
+#define _LOOP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <ucontext.h>
+
+#include "bl602flash.h"
+
+/* the stack of each session in a loop, the top of it is a guard page */
+#define LOOP_STACK_SIZE     (256 * 1024)
+
+/*
+ * Each session of a loop runs its steps on a stack of its own. Where the
+ * steps used to block in poll() or sleep, they hand the wait over to the
+ * loop instead: the events on the UART fd and/or a deadline, which the
+ * loop watches with epoll and a timerfd per session, and the session is
+ * resumed where it left off once one of them is there. This is the I/O
+ * state of a session kept for that.
+ *
+ * Not all of a session is on the loop thread: each flash data, xz or
+ * segment data transfer still starts a producer thread (pipeline.h),
+ * which builds the headers and checksums of the packets. The session
+ * waits for it on an eventfd in the loop, like for its UART.
+ */
+typedef struct {
+    bl602_loop_t *p_loop;           /* NULL: not in a loop, waits block */
+    ucontext_t ctx;                 /* where the session is suspended */
+    void *p_stack;
+    int wait_fd;                    /* the fd the events are waited on */
+    short events;                   /* POLLIN/POLLOUT waited for, 0 for none */
+    uint64_t deadline;              /* of the wait in mono_time_us, 0 for none */
+    int ready;                      /* the wait ended: 1 events, 0 timeout, -1 error */
+    int watched_fd;                 /* the fd registered with epoll, -1 for none */
+    uint32_t watched_events;
+    int timer_fd;
+    bool done;
+    int ret_code;                   /* of the session once done */
+} session_io_t;
+
+/*
+ * wait for events on the UART fd of p_ses until deadline (in usec of
+ * mono_time_us, 0 for none). Return 1 if ready, 0 if timed out, -1 on
+ * error or hang up.
+ */
+int session_wait(bl602_session_t *p_ses, short events, uint64_t deadline);
+
+/* the same on another fd of the session, e.g. the event of its pipeline */
+int session_wait_fd(bl602_session_t *p_ses, int fd, short events, uint64_t deadline);
+
+/* nothing to do for p_ses until deadline, at once if it is 0 or past */
+void session_sleep_until(bl602_session_t *p_ses, uint64_t deadline);
+
+#endif /* _LOOP_H */
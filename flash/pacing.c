@@ -0,0 +1,162 @@
+/*
+ * pacing of the commands between host and BL 60x
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "pacing.h"
+#include "uart.h"
+
+/* never wait longer than the fixed gap used before */
+#define PACE_GAP_MAX_US         (20 * 1000)
+#define PACE_GAP_STEP_US        1000
+/* number of good commands in a row before the gap shrinks */
+#define PACE_DECAY_STREAK       32
+
+static void pace_load(pace_t *p_pace) {
+    FILE *f = NULL;
+    unsigned int cmd_id = 0;
+    unsigned int gap_us = 0;
+    unsigned int latency_us = 0;
+
+    f = fopen(p_pace->path, "r");
+    if (f == NULL) {
+        return;
+    }
+    while (fscanf(f, "%x %u %u", &cmd_id, &gap_us, &latency_us) == 3) {
+        if (cmd_id < 256) {
+            p_pace->gap_us[cmd_id] = (gap_us > PACE_GAP_MAX_US) ? PACE_GAP_MAX_US : gap_us;
+            p_pace->latency_us[cmd_id] = latency_us;
+        }
+    }
+    fclose(f);
+}
+
+void pace_init(pace_t *p_pace, const char *p_uart_port) {
+    const char *p_home = getenv("HOME");
+    const char *p_base = NULL;
+
+    memset(p_pace, 0, sizeof(*p_pace));
+    if (p_home == NULL || p_uart_port == NULL) {
+        return;
+    }
+    /* one file per port, named after the device node */
+    p_base = strrchr(p_uart_port, '/');
+    p_base = (p_base == NULL) ? p_uart_port : p_base + 1;
+    snprintf(p_pace->path, sizeof p_pace->path, "%s/.cache/bl602_flash/pace_%s",
+            p_home, p_base);
+    pace_load(p_pace);
+}
+
+int pace_save(pace_t *p_pace) {
+    FILE *f = NULL;
+    char dir[PATH_MAX];
+    char *p_slash = NULL;
+    int i = 0;
+
+    if (!p_pace->dirty || p_pace->path[0] == '\0') {
+        return 0;
+    }
+    /* create $HOME/.cache/bl602_flash if needed */
+    snprintf(dir, sizeof dir, "%s", p_pace->path);
+    p_slash = strrchr(dir, '/');
+    *p_slash = '\0';
+    p_slash = strrchr(dir, '/');
+    *p_slash = '\0';
+    (void) mkdir(dir, 0755);
+    *p_slash = '/';
+    (void) mkdir(dir, 0755);
+
+    f = fopen(p_pace->path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    for (i = 0; i < 256; i++) {
+        if (p_pace->gap_us[i] != 0 || p_pace->latency_us[i] != 0) {
+            fprintf(f, "0x%02x %u %u\n", i, p_pace->gap_us[i], p_pace->latency_us[i]);
+        }
+    }
+    fclose(f);
+    p_pace->dirty = false;
+
+    return 0;
+}
+
+uint64_t pace_before_send(pace_t *p_pace, uint8_t cmd_id) {
+    uint64_t ready_us = p_pace->last_resp_us;
+    uint8_t last_cmd_id = p_pace->tx_cmd_id;
+
+    p_pace->tx_cmd_id = cmd_id;
+    if (p_pace->gap_us[cmd_id] == 0) {
+        return 0;
+    }
+    /*
+     * the last command is still in flight (a window of them): the device
+     * is ready when its response is expected, the gap counts from there
+     */
+    if (p_pace->tx_done_us > p_pace->last_resp_us) {
+        ready_us = p_pace->tx_done_us + p_pace->latency_us[last_cmd_id];
+    }
+
+    return ready_us + p_pace->gap_us[cmd_id];
+}
+
+void pace_after_send(pace_t *p_pace) {
+    p_pace->tx_done_us = mono_time_us();
+}
+
+void pace_after_response(pace_t *p_pace, uint8_t cmd_id, bool not_ready) {
+    uint64_t now = mono_time_us();
+    uint32_t latency_us = (uint32_t)(now - p_pace->tx_done_us);
+
+    p_pace->last_resp_us = now;
+    if (not_ready) {
+        /* the gap was too short, back off */
+        p_pace->gap_us[cmd_id] = (p_pace->gap_us[cmd_id] == 0) ? PACE_GAP_STEP_US
+            : p_pace->gap_us[cmd_id] * 2;
+        if (p_pace->gap_us[cmd_id] > PACE_GAP_MAX_US) {
+            p_pace->gap_us[cmd_id] = PACE_GAP_MAX_US;
+        }
+        p_pace->streak[cmd_id] = 0;
+        p_pace->dirty = true;
+        return;
+    }
+
+    /* smoothed latency: 7/8 of the history + 1/8 of the new sample */
+    if (p_pace->latency_us[cmd_id] == 0) {
+        p_pace->latency_us[cmd_id] = latency_us;
+    } else {
+        p_pace->latency_us[cmd_id] -= p_pace->latency_us[cmd_id] / 8;
+        p_pace->latency_us[cmd_id] += latency_us / 8;
+    }
+    p_pace->dirty = true;
+
+    if (p_pace->gap_us[cmd_id] != 0 && ++p_pace->streak[cmd_id] >= PACE_DECAY_STREAK) {
+        p_pace->gap_us[cmd_id] -= p_pace->gap_us[cmd_id] / 4;
+        if (p_pace->gap_us[cmd_id] < PACE_GAP_STEP_US / 4) {
+            p_pace->gap_us[cmd_id] = 0;
+        }
+        p_pace->streak[cmd_id] = 0;
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * pacing of the commands between host and BL 60x
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PACING_H
+#define _PACING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+/*
+ * The device is ready for the next command once it has answered the
+ * previous one, or, with a window of commands in flight, once the answer
+ * is expected: the smoothed response latency of the command after its
+ * last byte left the host. Some commands still need a short gap after
+ * that, e.g. the loader right after a hand shake. Instead of a fixed
+ * sleep before every command, the minimum gap is learned per command id:
+ * it grows when a command is not received properly, and decays while it
+ * works. The learned gaps and latencies are kept per port in
+ *      $HOME/.cache/bl602_flash/pace_<port>
+ */
+typedef struct {
+    char path[PATH_MAX];
+    uint64_t last_resp_us;      /* the device answered and is ready */
+    uint64_t tx_done_us;        /* the last packet left the host */
+    uint8_t tx_cmd_id;          /* and the command it carried */
+    uint32_t gap_us[256];       /* learned minimum gap per command id */
+    uint32_t latency_us[256];   /* smoothed response latency per command id */
+    uint32_t streak[256];
+    bool dirty;
+} pace_t;
+
+void pace_init(pace_t *p_pace, const char *p_uart_port);
+
+/* -1 if the file can not be written */
+int pace_save(pace_t *p_pace);
+
+/*
+ * when cmd_id may be sent, in mono_time_us: the gap of cmd_id after the
+ * device is ready; 0 if there is no gap to keep
+ */
+uint64_t pace_before_send(pace_t *p_pace, uint8_t cmd_id);
+
+/* the packet is on the wire, its last byte sent out */
+void pace_after_send(pace_t *p_pace);
+
+/* not_ready: the failure looks like the device was not ready to receive */
+void pace_after_response(pace_t *p_pace, uint8_t cmd_id, bool not_ready);
+
+#endif /* _PACING_H */
@@ -0,0 +1,199 @@
+/*
+ * producer/consumer pipeline of packets to the device
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "pipeline.h"
+#include "session.h"
+
+#define PIPE_SPINS          64
+
+/*
+ * wait a bit for the other side: spin first, as the other side is
+ * usually about to finish, then yield, then sleep in short steps so
+ * a stalled source (e.g. a slow network mount) does not burn a core
+ */
+static void pipe_backoff(uint32_t *p_spins) {
+    struct timespec ts = {0, 50 * 1000};
+
+    if (*p_spins < PIPE_SPINS) {
+        (*p_spins)++;
+    } else if (*p_spins < 2 * PIPE_SPINS) {
+        (*p_spins)++;
+        sched_yield();
+    } else {
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void *pipe_producer(void *p_arg) {
+    pipeline_t *p_pipe = (pipeline_t *)p_arg;
+    const flash_run_t *p_run = p_pipe->p_runs;
+    uint32_t i = 0;
+    uint32_t offset = 0;        /* within the current run */
+    uint32_t data_len = 0;
+    uint32_t spins = 0;
+
+    for (i = 0; i < p_pipe->n_frames; i++) {
+        /* wait for a free slot */
+        spins = 0;
+        while (i - atomic_load_explicit(&p_pipe->tail, memory_order_acquire) >= PIPE_SLOTS) {
+            if (atomic_load_explicit(&p_pipe->stop, memory_order_relaxed)) {
+                return NULL;
+            }
+            pipe_backoff(&spins);
+        }
+        while (offset == p_run->len) {
+            p_run++;
+            offset = 0;
+        }
+        data_len = p_run->len - offset;
+        if (data_len > p_pipe->max_payload) {
+            data_len = p_pipe->max_payload;
+        }
+        p_pipe->build(&p_pipe->p_slots[i % PIPE_SLOTS],
+                p_pipe->p_src + (p_run->addr - p_pipe->target_addr) + offset, data_len,
+                p_run->addr + offset);
+        offset += data_len;
+        /* publish the frame, and wake the consumer if it waits for it */
+        atomic_store(&p_pipe->head, i + 1);
+        if (atomic_exchange(&p_pipe->waiting, false)) {
+            uint64_t one = 1;
+
+            (void) write(p_pipe->event_fd, &one, sizeof one);
+        }
+    }
+
+    return NULL;
+}
+
+int pipeline_start(pipeline_t *p_pipe, const uint8_t *p_src, uint32_t len_src,
+        uint32_t max_payload, uint32_t target_addr, pipe_build_fn build) {
+    flash_run_t run = {target_addr, len_src};
+
+    return pipeline_start_runs(p_pipe, p_src, target_addr, &run, 1, max_payload, build);
+}
+
+int pipeline_start_runs(pipeline_t *p_pipe, const uint8_t *p_src, uint32_t target_addr,
+        const flash_run_t *p_runs, uint32_t n_runs, uint32_t max_payload,
+        pipe_build_fn build) {
+    uint32_t r = 0;
+
+    memset(p_pipe, 0, sizeof(*p_pipe));
+    if (max_payload == 0 || max_payload > PIPE_PAYLOAD_MAX) {
+        return -1;
+    }
+    p_pipe->p_src = p_src;
+    p_pipe->target_addr = target_addr;
+    p_pipe->p_runs = p_runs;
+    p_pipe->n_runs = n_runs;
+    /* a single run is kept in the pipeline, it may be on the caller's stack */
+    if (n_runs == 1) {
+        p_pipe->one_run = p_runs[0];
+        p_pipe->p_runs = &p_pipe->one_run;
+    }
+    p_pipe->max_payload = max_payload;
+    for (r = 0; r < n_runs; r++) {
+        p_pipe->n_frames += (p_runs[r].len + max_payload - 1) / max_payload;
+    }
+    p_pipe->build = build;
+    atomic_init(&p_pipe->head, 0);
+    atomic_init(&p_pipe->tail, 0);
+    atomic_init(&p_pipe->stop, false);
+    atomic_init(&p_pipe->waiting, false);
+
+    p_pipe->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (p_pipe->event_fd < 0) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: unable to create the packet pipeline event\n");
+        return -2;
+    }
+    p_pipe->p_slots = malloc(PIPE_SLOTS * sizeof(pipe_frame_t));
+    if (p_pipe->p_slots == NULL) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: malloc fail for the packet pipeline\n");
+        close(p_pipe->event_fd);
+        return -2;
+    }
+    if (pthread_create(&p_pipe->producer, NULL, pipe_producer, p_pipe) != 0) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: unable to start the packet producer\n");
+        close(p_pipe->event_fd);
+        free(p_pipe->p_slots);
+        p_pipe->p_slots = NULL;
+        return -3;
+    }
+
+    return 0;
+}
+
+bool pipeline_ready(pipeline_t *p_pipe, uint32_t idx) {
+    return idx >= p_pipe->n_frames
+        || atomic_load_explicit(&p_pipe->head, memory_order_acquire) > idx;
+}
+
+bool pipeline_arm(pipeline_t *p_pipe, uint32_t idx) {
+    uint64_t count = 0;
+
+    /* a wake up of an earlier wait may still be pending */
+    (void) read(p_pipe->event_fd, &count, sizeof count);
+    atomic_store(&p_pipe->waiting, true);
+    /* the producer may have published the frame before it saw the flag */
+    if (atomic_load(&p_pipe->head) > idx || idx >= p_pipe->n_frames) {
+        atomic_store(&p_pipe->waiting, false);
+        return false;
+    }
+
+    return true;
+}
+
+pipe_frame_t *pipeline_peek(pipeline_t *p_pipe, uint32_t idx) {
+    uint32_t spins = 0;
+
+    if (idx >= p_pipe->n_frames) {
+        return NULL;
+    }
+    while (atomic_load_explicit(&p_pipe->head, memory_order_acquire) <= idx) {
+        pipe_backoff(&spins);
+    }
+
+    return &p_pipe->p_slots[idx % PIPE_SLOTS];
+}
+
+void pipeline_release(pipeline_t *p_pipe) {
+    uint32_t tail = atomic_load_explicit(&p_pipe->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&p_pipe->tail, tail + 1, memory_order_release);
+}
+
+void pipeline_stop(pipeline_t *p_pipe) {
+    if (p_pipe->p_slots == NULL) {
+        return;
+    }
+    atomic_store_explicit(&p_pipe->stop, true, memory_order_relaxed);
+    pthread_join(p_pipe->producer, NULL);
+    close(p_pipe->event_fd);
+    free(p_pipe->p_slots);
+    p_pipe->p_slots = NULL;
+}
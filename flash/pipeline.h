@@ -0,0 +1,112 @@
+/*
+ * producer/consumer pipeline of packets to the device
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "packet_comm.h"
+#include "plan.h"
+
+/* number of frame buffers, a power of 2 */
+#define PIPE_SLOTS          32
+/* the header of flash data: command, checksum, length and address */
+#define PIPE_HDR_MAX        offsetof(flash_data_pkt_t, data)
+#define PIPE_PAYLOAD_MAX    FLASH_DATA_MAX
+
+/*
+ * A frame is the header of a packet only, the payload is sent from
+ * where it is in the source, the header and the payload in one writev.
+ */
+typedef struct {
+    uint32_t hdr_len;       /* bytes of the header */
+    uint32_t data_len;      /* bytes of the payload */
+    uint32_t addr;          /* target address of the payload */
+    const uint8_t *p_data;  /* the payload, within the source */
+    uint8_t hdr[PIPE_HDR_MAX];
+} pipe_frame_t;
+
+/* fill p_frame with the header of the command carrying data_len bytes of p_data */
+typedef void (*pipe_build_fn)(pipe_frame_t *p_frame, const uint8_t *p_data,
+        uint32_t data_len, uint32_t addr);
+
+/*
+ * A producer thread reads the source and builds the headers of the
+ * packets into a single-producer/single-consumer ring of preallocated
+ * frames, while the caller (the consumer) only writes them out and
+ * handles the acks. The checksums, and with them the page faults of
+ * the image, are thus off the UART path.
+ *
+ * Frames are numbered from 0. The consumer may look at any frame from
+ * the oldest unreleased one on, so packets in flight can be resent, and
+ * releases them in order once acked.
+ */
+typedef struct {
+    const uint8_t *p_src;       /* the byte to go to target_addr */
+    uint32_t target_addr;
+    const flash_run_t *p_runs;  /* the parts of the source to send */
+    uint32_t n_runs;
+    flash_run_t one_run;
+    uint32_t max_payload;
+    uint32_t n_frames;
+    pipe_build_fn build;
+    pipe_frame_t *p_slots;
+    _Atomic uint32_t head;      /* frames built, written by the producer */
+    _Atomic uint32_t tail;      /* frames released, written by the consumer */
+    atomic_bool stop;
+    atomic_bool waiting;        /* the consumer waits on event_fd for the next frame */
+    int event_fd;               /* signaled by the producer, see pipeline_arm */
+    pthread_t producer;
+} pipeline_t;
+
+int pipeline_start(pipeline_t *p_pipe, const uint8_t *p_src, uint32_t len_src,
+        uint32_t max_payload, uint32_t target_addr, pipe_build_fn build);
+
+/*
+ * Only the runs (in address order, within the source) are framed, each
+ * one cut into packets of up to max_payload bytes. p_runs must stay
+ * valid until pipeline_stop.
+ */
+int pipeline_start_runs(pipeline_t *p_pipe, const uint8_t *p_src, uint32_t target_addr,
+        const flash_run_t *p_runs, uint32_t n_runs, uint32_t max_payload,
+        pipe_build_fn build);
+
+/* frame idx is built, or past the last frame: pipeline_peek does not wait */
+bool pipeline_ready(pipeline_t *p_pipe, uint32_t idx);
+
+/*
+ * the consumer is about to wait for frame idx: true if it is still not
+ * built, then event_fd is readable once the producer built another frame
+ */
+bool pipeline_arm(pipeline_t *p_pipe, uint32_t idx);
+
+/* frame idx, waiting for the producer if needed; NULL past the last frame */
+pipe_frame_t *pipeline_peek(pipeline_t *p_pipe, uint32_t idx);
+
+/* the oldest frame is done with, its buffer goes back to the producer */
+void pipeline_release(pipeline_t *p_pipe);
+
+void pipeline_stop(pipeline_t *p_pipe);
+
+#endif /* _PIPELINE_H */
@@ -0,0 +1,117 @@
+/*
+ * packet sizes accepted by the bootrom and the eflash loader
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "packet_comm.h"
+#include "pktsize.h"
+
+/* the ports flashed at once share the file */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void pktsize_init(pktsize_t *p_pkt, const uint32_t *p_loader_sha256) {
+    const char *p_home = getenv("HOME");
+    FILE *f = NULL;
+    char name[16];
+    unsigned int size = 0;
+    int i = 0;
+    int n = 0;
+
+    /* the sizes used before the probe, known to work */
+    memset(p_pkt, 0, sizeof(*p_pkt));
+    p_pkt->seg_payload = 2048;
+    p_pkt->flash_payload = 8 * 1024;
+    if (p_home == NULL) {
+        return;
+    }
+    n = snprintf(p_pkt->path, sizeof p_pkt->path, "%s/.cache/bl602_flash/pkt_", p_home);
+    for (i = 0; i < 8 && n > 0 && n < (int)sizeof p_pkt->path; i++) {
+        n += snprintf(p_pkt->path + n, sizeof p_pkt->path - n, "%08x", p_loader_sha256[i]);
+    }
+
+    f = fopen(p_pkt->path, "r");
+    if (f == NULL) {
+        return;
+    }
+    while (fscanf(f, "%15s %u", name, &size) == 2) {
+        if (size < PKT_PAYLOAD_MIN) {
+            continue;
+        }
+        if (strcmp(name, "seg") == 0 && size <= SEG_DATA_MAX) {
+            p_pkt->seg_payload = size;
+            p_pkt->seg_payload_known = true;
+        } else if (strcmp(name, "flash") == 0 && size <= FLASH_DATA_MAX) {
+            p_pkt->flash_payload = size;
+            p_pkt->flash_payload_known = true;
+        }
+    }
+    fclose(f);
+}
+
+void pktsize_found(pktsize_t *p_pkt, uint32_t *p_payload, bool *p_known, uint32_t size) {
+    if (!*p_known || *p_payload != size) {
+        p_pkt->dirty = true;
+    }
+    *p_payload = size;
+    *p_known = true;
+}
+
+int pktsize_save(pktsize_t *p_pkt) {
+    FILE *f = NULL;
+    char dir[PATH_MAX];
+    char *p_slash = NULL;
+
+    if (!p_pkt->dirty || p_pkt->path[0] == '\0') {
+        return 0;
+    }
+    /* create $HOME/.cache/bl602_flash if needed */
+    snprintf(dir, sizeof dir, "%s", p_pkt->path);
+    p_slash = strrchr(dir, '/');
+    *p_slash = '\0';
+    p_slash = strrchr(dir, '/');
+    *p_slash = '\0';
+    (void) mkdir(dir, 0755);
+    *p_slash = '/';
+    (void) mkdir(dir, 0755);
+
+    pthread_mutex_lock(&cache_lock);
+    f = fopen(p_pkt->path, "w");
+    if (f == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    if (p_pkt->seg_payload_known) {
+        fprintf(f, "seg %u\n", p_pkt->seg_payload);
+    }
+    if (p_pkt->flash_payload_known) {
+        fprintf(f, "flash %u\n", p_pkt->flash_payload);
+    }
+    fclose(f);
+    pthread_mutex_unlock(&cache_lock);
+    p_pkt->dirty = false;
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * packet sizes accepted by the bootrom and the eflash loader
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PKTSIZE_H
+#define _PKTSIZE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+/*
+ * The payload sizes of segment data (bootrom) and flash data (eflash
+ * loader) packets, up to SEG_DATA_MAX and FLASH_DATA_MAX. Until known,
+ * they are probed: the first packet is tried from the largest size down,
+ * halving on each error. The sizes found are kept per eflash loader in
+ *      $HOME/.cache/bl602_flash/pkt_<SHA256 of the loader>
+ */
+#define PKT_PAYLOAD_MIN         1024
+
+/* per session, as each port probes its own */
+typedef struct {
+    uint32_t seg_payload;
+    bool seg_payload_known;
+    uint32_t flash_payload;
+    bool flash_payload_known;
+    char path[PATH_MAX];
+    bool dirty;
+} pktsize_t;
+
+/* the sizes found before with this loader, if any */
+void pktsize_init(pktsize_t *p_pkt, const uint32_t *p_loader_sha256);
+
+/* a probe found a size, p_payload and p_known are within p_pkt */
+void pktsize_found(pktsize_t *p_pkt, uint32_t *p_payload, bool *p_known, uint32_t size);
+
+/* -1 if the file can not be written */
+int pktsize_save(pktsize_t *p_pkt);
+
+#endif /* _PKTSIZE_H */
@@ -0,0 +1,269 @@
+/*
+ * planning of the erase and program operations over all images
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "packet_comm.h"
+#include "plan.h"
+#include "session.h"
+
+#define BLOCK_32K       (32 * 1024)
+#define BLOCK_64K       (64 * 1024)
+
+void plan_geometry(const image_view_t *p_eflash, flash_geometry_t *p_geom) {
+    const Boot_Header_Config *p_bhc = (const Boot_Header_Config *)p_eflash->p_data;
+
+    /* a common 4K sector NOR flash, if the header does not tell */
+    p_geom->sector_size = 4096;
+    p_geom->time_sector_ms = 300;
+    p_geom->time_32k_ms = 1200;
+    p_geom->time_64k_ms = 1200;
+    p_geom->time_chip_ms = 33000;
+    if (p_eflash->size < sizeof(*p_bhc)) {
+        return;
+    }
+    if (p_bhc->flashCfg.cfg.sectorSize != 0) {
+        p_geom->sector_size = p_bhc->flashCfg.cfg.sectorSize * 1024;
+    }
+    if (p_bhc->flashCfg.cfg.timeEsector != 0) {
+        p_geom->time_sector_ms = p_bhc->flashCfg.cfg.timeEsector;
+    }
+    if (p_bhc->flashCfg.cfg.timeE32k != 0) {
+        p_geom->time_32k_ms = p_bhc->flashCfg.cfg.timeE32k;
+    }
+    if (p_bhc->flashCfg.cfg.timeE64k != 0) {
+        p_geom->time_64k_ms = p_bhc->flashCfg.cfg.timeE64k;
+    }
+    if (p_bhc->flashCfg.cfg.timeCe != 0) {
+        p_geom->time_chip_ms = p_bhc->flashCfg.cfg.timeCe;
+    }
+}
+
+static int cmp_run(const void *p_a, const void *p_b) {
+    const flash_run_t *p_run_a = (const flash_run_t *)p_a;
+    const flash_run_t *p_run_b = (const flash_run_t *)p_b;
+
+    return (p_run_a->addr > p_run_b->addr) - (p_run_a->addr < p_run_b->addr);
+}
+
+int plan_erase(const flash_geometry_t *p_geom, const flash_run_t *p_runs, uint32_t n_runs,
+        flash_run_t **pp_erase, uint32_t *p_n_erase) {
+    flash_run_t *p_erase = NULL;
+    uint32_t sector = p_geom->sector_size;
+    uint32_t n_erase = 0;
+    uint32_t start = 0;
+    uint32_t end = 0;
+    uint32_t i = 0;
+
+    *pp_erase = NULL;
+    *p_n_erase = 0;
+    if (n_runs == 0) {
+        return 0;
+    }
+    p_erase = malloc(n_runs * sizeof(flash_run_t));
+    if (p_erase == NULL) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: malloc fail for the erase plan\n");
+        return -1;
+    }
+    /* the flash can only erase whole sectors */
+    for (i = 0; i < n_runs; i++) {
+        if (p_runs[i].len == 0) {
+            continue;
+        }
+        start = p_runs[i].addr - p_runs[i].addr % sector;
+        end = p_runs[i].addr + p_runs[i].len;
+        end = (end + sector - 1) / sector * sector;
+        p_erase[n_erase].addr = start;
+        p_erase[n_erase].len = end - start;
+        n_erase++;
+    }
+    qsort(p_erase, n_erase, sizeof(flash_run_t), cmp_run);
+
+    /* merge in place */
+    n_runs = n_erase;
+    n_erase = (n_runs > 0) ? 1 : 0;
+    for (i = 1; i < n_runs; i++) {
+        flash_run_t *p_last = &p_erase[n_erase - 1];
+
+        if (p_erase[i].addr <= p_last->addr + p_last->len) {
+            end = p_erase[i].addr + p_erase[i].len;
+            if (end > p_last->addr + p_last->len) {
+                p_last->len = end - p_last->addr;
+            }
+        } else {
+            p_erase[n_erase++] = p_erase[i];
+        }
+    }
+
+    *pp_erase = p_erase;
+    *p_n_erase = n_erase;
+    return 0;
+}
+
+uint32_t plan_program(const flash_run_t *p_erase, uint32_t n_erase, uint32_t addr,
+        uint32_t len, flash_run_t *p_out) {
+    uint32_t n_out = 0;
+    uint32_t start = 0;
+    uint32_t end = 0;
+    uint32_t i = 0;
+
+    for (i = 0; i < n_erase; i++) {
+        start = (p_erase[i].addr > addr) ? p_erase[i].addr : addr;
+        end = p_erase[i].addr + p_erase[i].len;
+        end = (end < addr + len) ? end : addr + len;
+        if (start < end) {
+            p_out[n_out].addr = start;
+            p_out[n_out].len = end - start;
+            n_out++;
+        }
+    }
+
+    return n_out;
+}
+
+uint32_t plan_erase_time_ms(const flash_geometry_t *p_geom, uint32_t addr, uint32_t len) {
+    uint32_t end = addr + len;
+    uint32_t time_ms = 0;
+
+    while (addr < end) {
+        if (addr % BLOCK_64K == 0 && end - addr >= BLOCK_64K) {
+            time_ms += p_geom->time_64k_ms;
+            addr += BLOCK_64K;
+        } else if (addr % BLOCK_32K == 0 && end - addr >= BLOCK_32K) {
+            time_ms += p_geom->time_32k_ms;
+            addr += BLOCK_32K;
+        } else {
+            time_ms += p_geom->time_sector_ms;
+            addr += p_geom->sector_size - addr % p_geom->sector_size;
+        }
+    }
+
+    return time_ms;
+}
+
+/* true if the len bytes at p_data are all 0xFF */
+static bool is_erased(const uint8_t *p_data, uint32_t len) {
+#if defined(__SSE2__)
+    const __m128i ones = _mm_set1_epi8((char)0xFF);
+
+    /* AND 64 bytes together, a single clear bit shows up in the result */
+    while (len >= 64) {
+        __m128i v = _mm_and_si128(
+                _mm_and_si128(_mm_loadu_si128((const __m128i *)p_data),
+                    _mm_loadu_si128((const __m128i *)(p_data + 16))),
+                _mm_and_si128(_mm_loadu_si128((const __m128i *)(p_data + 32)),
+                    _mm_loadu_si128((const __m128i *)(p_data + 48))));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xFFFF) {
+            return false;
+        }
+        p_data += 64;
+        len -= 64;
+    }
+#else
+    uint64_t w = 0;
+
+    while (len >= 8) {
+        memcpy(&w, p_data, sizeof w);
+        if (w != UINT64_MAX) {
+            return false;
+        }
+        p_data += 8;
+        len -= 8;
+    }
+#endif
+    while (len > 0) {
+        if (*p_data != 0xFF) {
+            return false;
+        }
+        p_data++;
+        len--;
+    }
+
+    return true;
+}
+
+uint32_t plan_sparse(const uint8_t *p_data, uint32_t len, uint32_t addr, flash_run_t *p_out) {
+    uint32_t n_out = 0;
+    uint32_t offset = 0;
+    uint32_t chunk = 0;
+    bool in_run = false;
+
+    for (offset = 0; offset < len; offset += chunk) {
+        chunk = (len - offset > PLAN_SPARSE_GRANULE) ? PLAN_SPARSE_GRANULE : len - offset;
+        if (is_erased(p_data + offset, chunk)) {
+            in_run = false;
+            continue;
+        }
+        if (in_run) {
+            p_out[n_out - 1].len += chunk;
+        } else {
+            p_out[n_out].addr = addr + offset;
+            p_out[n_out].len = chunk;
+            n_out++;
+            in_run = true;
+        }
+    }
+
+    return n_out;
+}
+
+uint32_t plan_sparse_bytes(const uint8_t *p_data, uint32_t len) {
+    uint32_t bytes = 0;
+    uint32_t offset = 0;
+    uint32_t chunk = 0;
+
+    for (offset = 0; offset < len; offset += chunk) {
+        chunk = (len - offset > PLAN_SPARSE_GRANULE) ? PLAN_SPARSE_GRANULE : len - offset;
+        if (!is_erased(p_data + offset, chunk)) {
+            bytes += chunk;
+        }
+    }
+
+    return bytes;
+}
+
+/* append [addr, addr + len) to the growing array *pp_runs */
+int plan_add_run(flash_run_t **pp_runs, uint32_t *p_n_runs, uint32_t *p_cap,
+        uint32_t addr, uint32_t len)
+{
+    flash_run_t *p_new = NULL;
+
+    if (*p_n_runs == *p_cap) {
+        p_new = realloc(*pp_runs, (*p_cap + 8) * sizeof(flash_run_t));
+        if (p_new == NULL) {
+            flash_log(NULL, BL602_LOG_ERROR, "ERROR: malloc fail for the flash plan\n");
+            return -1;
+        }
+        *pp_runs = p_new;
+        *p_cap += 8;
+    }
+    (*pp_runs)[*p_n_runs].addr = addr;
+    (*pp_runs)[*p_n_runs].len = len;
+    (*p_n_runs)++;
+
+    return 0;
+}
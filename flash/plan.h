@@ -0,0 +1,89 @@
+/*
+ * planning of the erase and program operations over all images
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PLAN_H
+#define _PLAN_H
+
+#include <stdint.h>
+
+#include "image.h"
+
+/* a range of flash to be erased and/or programmed */
+typedef struct {
+    uint32_t addr;
+    uint32_t len;
+} flash_run_t;
+
+/* from Boot_Flash_Config, times are the worst case in ms */
+typedef struct {
+    uint32_t sector_size;
+    uint32_t time_sector_ms;
+    uint32_t time_32k_ms;
+    uint32_t time_64k_ms;
+    uint32_t time_chip_ms;
+} flash_geometry_t;
+
+/* the geometry the eflash loader is given in its boot header */
+void plan_geometry(const image_view_t *p_eflash, flash_geometry_t *p_geom);
+
+/*
+ * Round the runs to be written out to sector boundaries, and merge the
+ * ones which overlap or touch. *pp_erase is allocated, in address order.
+ */
+int plan_erase(const flash_geometry_t *p_geom, const flash_run_t *p_runs, uint32_t n_runs,
+        flash_run_t **pp_erase, uint32_t *p_n_erase);
+
+/*
+ * The parts of [addr, addr + len) inside the erased ranges, all of which
+ * have to be programmed again. p_out has room for n_erase runs, the
+ * number of runs is returned.
+ */
+uint32_t plan_program(const flash_run_t *p_erase, uint32_t n_erase, uint32_t addr,
+        uint32_t len, flash_run_t *p_out);
+
+/*
+ * worst case time to erase the range, as the flash would do it: 64K
+ * blocks where aligned, then 32K blocks, then sectors
+ */
+uint32_t plan_erase_time_ms(const flash_geometry_t *p_geom, uint32_t addr, uint32_t len);
+
+/*
+ * Erased flash reads 0xFF, so programming 0xFF is a no-op. The data is
+ * scanned in granules of PLAN_SPARSE_GRANULE bytes, the ones which are
+ * all 0xFF are left out, the others are merged into runs.
+ */
+#define PLAN_SPARSE_GRANULE     1024
+#define PLAN_SPARSE_MAX_RUNS(len)   \
+    (((len) + PLAN_SPARSE_GRANULE - 1) / PLAN_SPARSE_GRANULE / 2 + 1)
+
+/*
+ * The parts of p_data, to be programmed at addr, which are not all 0xFF.
+ * p_out has room for PLAN_SPARSE_MAX_RUNS(len) runs, the number of runs
+ * is returned.
+ */
+uint32_t plan_sparse(const uint8_t *p_data, uint32_t len, uint32_t addr, flash_run_t *p_out);
+
+/* the number of bytes in the runs plan_sparse would return */
+uint32_t plan_sparse_bytes(const uint8_t *p_data, uint32_t len);
+
+/* append [addr, addr + len) to the growing array *pp_runs */
+int plan_add_run(flash_run_t **pp_runs, uint32_t *p_n_runs, uint32_t *p_cap,
+        uint32_t addr, uint32_t len);
+
+#endif /* _PLAN_H */
@@ -0,0 +1,87 @@
+/*
+ * the partition table made by partition_gen, to find where the images go
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "ptable.h"
+#include "session.h"
+
+int ptable_load(const image_view_t *p_image, pt_table_stuff_config_t *p_table) {
+    const pt_table_config_t *p_hdr = (const pt_table_config_t *)p_image->p_data;
+    uint32_t len_entries = 0;
+    uint32_t crc32 = 0;
+
+    memset(p_table, 0, sizeof(*p_table));
+    if (p_image->size < sizeof(*p_hdr) || p_hdr->magic != BFLB_PT_MAGIC_CODE) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: not a partition table\n");
+        return -1;
+    }
+    if (p_hdr->crc32 != calc_crc32((const char *)p_hdr, offsetof(pt_table_config_t, crc32))) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: CRC32 of the partition table header mismatch\n");
+        return -2;
+    }
+    if (p_hdr->entry_cnt > PT_ENTRY_MAX) {
+        flash_log(NULL, BL602_LOG_ERROR,
+                "ERROR: %u partition entries, at most %d\n", p_hdr->entry_cnt,
+                PT_ENTRY_MAX);
+        return -3;
+    }
+    len_entries = p_hdr->entry_cnt * sizeof(p_table->pt_entries[0]);
+    if (p_image->size < sizeof(*p_hdr) + len_entries + sizeof(crc32)) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: the partition table is cut short\n");
+        return -3;
+    }
+    memcpy(p_table, p_hdr, sizeof(*p_hdr) + len_entries);
+    memcpy(&crc32, p_image->p_data + sizeof(*p_hdr) + len_entries, sizeof(crc32));
+    if (crc32 != calc_crc32((const char *)p_table->pt_entries, len_entries)) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: CRC32 of the partition entries mismatch\n");
+        return -2;
+    }
+    p_table->crc32 = crc32;
+
+    return 0;
+}
+
+int ptable_find(const pt_table_stuff_config_t *p_table, const char *p_name,
+        uint32_t *p_addr, uint32_t *p_max_len) {
+    const pt_table_entry_config_t *p_entry = NULL;
+    uint32_t i = 0;
+
+    for (i = 0; i < p_table->pt_table.entry_cnt; i++) {
+        p_entry = &p_table->pt_entries[i];
+        if (strncmp((const char *)p_entry->name, p_name, sizeof(p_entry->name)) != 0) {
+            continue;
+        }
+        if (p_entry->active_index > 1) {
+            flash_log(NULL, BL602_LOG_ERROR, "ERROR: partition %s has no slot %u\n", p_name,
+                    p_entry->active_index);
+            return -2;
+        }
+        *p_addr = p_entry->address[p_entry->active_index];
+        *p_max_len = p_entry->max_len[p_entry->active_index];
+        return 0;
+    }
+    flash_log(NULL, BL602_LOG_ERROR, "ERROR: no partition %s in the partition table\n", p_name);
+
+    return -1;
+}
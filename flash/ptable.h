@@ -0,0 +1,38 @@
+/*
+ * the partition table made by partition_gen, to find where the images go
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _PTABLE_H
+#define _PTABLE_H
+
+#include <stdint.h>
+
+#include "image.h"
+#include "../partition/partition.h"
+
+/*
+ * Check the table image: magic, the number of entries, the CRC32 of the
+ * table header and the one of the entries, which follows the last entry.
+ */
+int ptable_load(const image_view_t *p_image, pt_table_stuff_config_t *p_table);
+
+/* the address and size of the active slot of the entry named p_name */
+int ptable_find(const pt_table_stuff_config_t *p_table, const char *p_name,
+        uint32_t *p_addr, uint32_t *p_max_len);
+
+#endif /* _PTABLE_H */
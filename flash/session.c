@@ -0,0 +1,800 @@
+/*
+ * libbl602flash, a session with a board from the bootrom to the images
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "uart.h"
+#include "comm.h"
+#include "pacing.h"
+#include "image.h"
+#include "delta.h"
+#include "compress.h"
+#include "pktsize.h"
+#include "journal.h"
+#include "plan.h"
+#include "bundle.h"
+#include "session.h"
+#include "crypto.h"
+#include "common_share.h"
+#include "packet_comm.h"
+
+void flash_log(const bl602_session_t *p_ses, int level, const char *p_fmt, ...)
+{
+    char text[512];
+    va_list args;
+
+    va_start(args, p_fmt);
+    if (p_ses == NULL || p_ses->log_cb == NULL) {
+        vfprintf((level <= BL602_LOG_WARNING) ? stderr : stdout, p_fmt, args);
+        va_end(args);
+        return;
+    }
+    /* longer lines are cut */
+    vsnprintf(text, sizeof text, p_fmt, args);
+    va_end(args);
+    p_ses->log_cb(p_ses->p_log_user, level, text);
+}
+
+/* the rates tried with the eflash loader, from high to low */
+static const uint32_t baud_ladder[] = {
+    2000000, 1500000, 1000000, 921600, 500000, 460800, 230400, 115200
+};
+
+/* the loader and the images straight from a bundle, nothing to work out */
+int load_bundle(flash_config_t *p_cfg, const char *p_path)
+{
+    const bundle_entry_t *p_entries = NULL;
+    uint32_t n_entries = 0;
+    bool has_loader = false;
+    uint32_t i = 0;
+    int ret_code = 0;
+
+    ret_code = bundle_open(p_path, &p_cfg->bundle, &p_entries, &n_entries);
+    if (ret_code != 0) {
+        return ret_code;
+    }
+    p_cfg->n_jobs = 0;
+    for (i = 0; i < n_entries; i++) {
+        const bundle_entry_t *p_entry = &p_entries[i];
+
+        if (memchr(p_entry->name, '\0', sizeof(p_entry->name)) == NULL) {
+            flash_log(NULL, BL602_LOG_ERROR, "ERROR: invalid name in the bundle manifest\n");
+            ret_code = -1;
+            goto fail;
+        }
+        if (p_entry->type == BUNDLE_LOADER && !has_loader) {
+            bundle_view(&p_cfg->bundle, p_entry, &p_cfg->eflash_loader);
+            memcpy(p_cfg->loader_sha256, p_entry->sha256, sizeof(p_cfg->loader_sha256));
+            has_loader = true;
+        } else if (p_entry->type == BUNDLE_IMAGE && p_cfg->n_jobs < ARRAY_SIZE(p_cfg->jobs)) {
+            flash_job_t *p_job = &p_cfg->jobs[p_cfg->n_jobs++];
+
+            bundle_view(&p_cfg->bundle, p_entry, &p_job->image);
+            p_job->p_name = p_entry->name;
+            p_job->dst = p_entry->dst;
+            memcpy(p_job->sha_256, p_entry->sha256, sizeof(p_job->sha_256));
+        }
+    }
+    if (!has_loader || p_cfg->n_jobs == 0) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: no eflash loader or no image in %s\n", p_path);
+        ret_code = -2;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    /* the views point into the bundle, they go with it */
+    memset(&p_cfg->eflash_loader, 0, sizeof(p_cfg->eflash_loader));
+    for (i = 0; i < p_cfg->n_jobs; i++) {
+        memset(&p_cfg->jobs[i].image, 0, sizeof(p_cfg->jobs[i].image));
+        p_cfg->jobs[i].p_name = NULL;
+    }
+    p_cfg->n_jobs = 0;
+    image_close(&p_cfg->bundle);
+    return ret_code;
+}
+
+int compress_jobs(flash_config_t *p_cfg)
+{
+    flash_job_t *p_job = NULL;
+    uint32_t i = 0;
+    int ret_code = 0;
+
+    for (i = 0; i < p_cfg->n_jobs; i++) {
+        p_job = &p_cfg->jobs[i];
+        if (p_job->p_xz != NULL) {
+            continue;
+        }
+        ret_code = compress_data(p_job->image.p_data, p_job->image.size, &p_job->p_xz,
+                &p_job->len_xz);
+        if (ret_code != 0) {
+            return ret_code;
+        }
+        flash_log(NULL, BL602_LOG_INFO, "xz: %s %u bytes to %u\n", p_job->p_name,
+                p_job->image.size, p_job->len_xz);
+    }
+
+    return 0;
+}
+
+void free_jobs_xz(flash_config_t *p_cfg)
+{
+    uint32_t i = 0;
+
+    for (i = 0; i < ARRAY_SIZE(p_cfg->jobs); i++) {
+        free(p_cfg->jobs[i].p_xz);
+        p_cfg->jobs[i].p_xz = NULL;
+        p_cfg->jobs[i].len_xz = 0;
+    }
+}
+
+/*
+ * program [addr, addr + len) of the image, just erased; with the xz
+ * streams of the image if asked for, the run is the whole image and
+ * they are worth it at rate
+ */
+static int program_run(bl602_session_t *p_ctx, const flash_job_t *p_job, uint32_t addr,
+        uint32_t len, bool compress, uint32_t rate)
+{
+    int ret_code = 0;
+    uint8_t *p_data = p_job->image.p_data + (addr - p_job->dst);
+    uint32_t len_raw = 0;
+
+    if (compress && p_job->p_xz != NULL && addr == p_job->dst && len == p_job->image.size) {
+        len_raw = plan_sparse_bytes(p_data, len);
+        if (compress_pays(len_raw, p_job->len_xz, len, rate)) {
+            flash_log(p_ctx, BL602_LOG_INFO, "xz: %u bytes to send instead of %u\n", p_job->len_xz,
+                    len_raw);
+            ret_code = flash_data_xz(p_ctx, p_job->p_xz, p_job->len_xz, addr);
+            if (ret_code == 0) {
+                journal_acked(&p_ctx->journal, addr, len, p_data);
+            }
+            return ret_code;
+        }
+        flash_log(p_ctx, BL602_LOG_INFO,
+                "xz: %u bytes do not pay off against %u, sent as they are\n",
+                p_job->len_xz, len_raw);
+    }
+
+    return flash_data(p_ctx, p_data, len, addr, true);
+}
+
+/*
+ * hand shake with the eflash loader at rate, and make sure the link
+ * really works with a command carrying binary payload
+ */
+static int try_baud_rate(bl602_session_t *p_ctx, uint32_t rate)
+{
+    uint32_t sha_256[8];
+    int ret_code = 0;
+
+    /* the last command goes out at the old rate, waited for in the loop */
+    (void) uart_wait_sent(p_ctx, p_ctx->resp_timeout_ms);
+    ret_code = uart_set_baud_rate(p_ctx->uart_fd, rate);
+    if (ret_code != 0) {
+        flash_log(p_ctx, BL602_LOG_ERROR, "ERROR: unable to set baud rate %u\n", rate);
+        return ret_code;
+    }
+    p_ctx->baud_rate = rate;
+    ret_code = hand_shake(p_ctx, rate);
+    if (ret_code == 0) {
+        ret_code = request_sha256(p_ctx, 0, 256, sha_256);
+    }
+    if (ret_code != 0) {
+        flash_log(p_ctx, BL602_LOG_WARNING, "WARNING: baud rate %u does not work\n\n", rate);
+    }
+
+    return ret_code;
+}
+
+/*
+ * walk down the ladder from max_rate until the eflash loader answers,
+ * safe_rate (the one working with bootrom) is the last resort.
+ */
+static int climb_baud_ladder(bl602_session_t *p_ctx, uint32_t safe_rate, uint32_t max_rate,
+        uint32_t *p_rate)
+{
+    int i = 0;
+
+    if (max_rate > safe_rate && try_baud_rate(p_ctx, max_rate) == 0) {
+        *p_rate = max_rate;
+        return 0;
+    }
+    for (i = 0; i < ARRAY_SIZE(baud_ladder); i++) {
+        if (baud_ladder[i] >= max_rate || baud_ladder[i] <= safe_rate) {
+            continue;
+        }
+        if (try_baud_rate(p_ctx, baud_ladder[i]) == 0) {
+            *p_rate = baud_ladder[i];
+            return 0;
+        }
+    }
+    *p_rate = safe_rate;
+    return try_baud_rate(p_ctx, safe_rate);
+}
+
+static const char *state_names[] = {
+    [FS_HAND_SHAKE] = "hand shake",
+    [FS_BOOT_INFO] = "boot info",
+    [FS_BOOT_HEADER] = "boot header",
+    [FS_PUB_KEY] = "public key",
+    [FS_SIGNATURE] = "signature",
+    [FS_AES_IV] = "AES IV",
+    [FS_SEGMENT_HEADER] = "segment header",
+    [FS_SEGMENT_DATA] = "segment data",
+    [FS_CHECK_IMAGE] = "check image",
+    [FS_RUN_IMAGE] = "run image",
+    [FS_LOADER_HAND_SHAKE] = "loader hand shake",
+    [FS_PLAN] = "plan",
+    [FS_ERASE] = "erase",
+    [FS_PROGRAM] = "program",
+    [FS_PROGRAM_DONE] = "program done",
+    [FS_VERIFY] = "verify",
+    [FS_FINISH] = "finish",
+    [FS_DONE] = "done",
+};
+
+const char *flash_state_name(flash_state_t state)
+{
+    return state_names[state];
+}
+
+/* what a session with a board is at */
+typedef struct {
+    bl602_session_t *p_ctx;
+    const flash_config_t *p_cfg;
+    flash_state_t state;
+    uint32_t flash_rate;
+    int chip_erase;
+    boot_info_t boot_info;
+    flash_geometry_t geom;
+    flash_run_t *p_writes;          /* what the images need written */
+    uint32_t n_writes;
+    uint32_t writes_cap;
+    flash_run_t *p_erase;
+    uint32_t n_erase;
+    uint32_t job;                   /* the image programmed */
+} flash_session_t;
+
+/*
+ * what the device still holds of the image from a session which failed,
+ * as far as the journal says and the device confirms, in whole sectors
+ */
+static uint32_t resume_len(flash_session_t *p_ses, const flash_job_t *p_job)
+{
+    uint32_t sector = p_ses->geom.sector_size;
+    uint32_t dev_sha_256[8] = {0};
+    uint32_t sha_256[8];
+    uint32_t len = 0;
+
+    len = journal_covered(&p_ses->p_ctx->journal, p_job->image.p_data, p_job->image.size,
+            p_job->dst);
+    /* the sector the journal stops in is erased again */
+    if (len < p_job->image.size) {
+        len = (p_job->dst + len) / sector * sector;
+        len = (len > p_job->dst) ? len - p_job->dst : 0;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    calc_sha256(p_job->image.p_data, len, sha_256);
+    if (request_sha256(p_ses->p_ctx, p_job->dst, len, dev_sha_256) != 0
+            || memcmp(sha_256, dev_sha_256, sizeof sha_256) != 0) {
+        flash_log(p_ses->p_ctx, BL602_LOG_WARNING,
+                "WARNING: the journal does not match the device, "
+                "%s is flashed in full\n", p_job->p_name);
+        return 0;
+    }
+    journal_keep(&p_ses->p_ctx->journal, p_job->dst, len);
+    flash_log(p_ses->p_ctx, BL602_LOG_INFO, "resume: %s from 0x%08x, %u bytes already there\n\n",
+            p_job->p_name, p_job->dst + len, len);
+
+    return len;
+}
+
+/* phase 1: what has to be written, image by image */
+static int plan_writes(flash_session_t *p_ses)
+{
+    const flash_config_t *p_cfg = p_ses->p_cfg;
+    bool resumed = false;
+    int ret_code = 0;
+    uint32_t j = 0;
+
+    for (j = 0; j < p_cfg->n_jobs; j++) {
+        const flash_job_t *p_job = &p_cfg->jobs[j];
+        uint32_t dev_sha_256[8] = {0};
+        flash_run_t *p_delta_runs = NULL;
+        uint32_t n_runs = 0;
+        uint32_t done = 0;
+        uint32_t r = 0;
+
+        /* the device already holds this image, nothing to do */
+        if (p_ses->chip_erase != CHIP_ERASE_ON && p_cfg->skip_unchanged
+                && request_sha256(p_ses->p_ctx, p_job->dst, p_job->image.size,
+                    dev_sha_256) == 0
+                && memcmp(p_job->sha_256, dev_sha_256, sizeof dev_sha_256) == 0) {
+            flash_log(p_ses->p_ctx, BL602_LOG_INFO,
+                    "SUCCEED: %s unchanged at 0x%08x\n\n", p_job->p_name, p_job->dst);
+            continue;
+        }
+        if (!p_cfg->delta || p_ses->chip_erase == CHIP_ERASE_ON) {
+            /* take up from where a session which failed stopped */
+            done = (p_ses->chip_erase == CHIP_ERASE_ON) ? 0 : resume_len(p_ses, p_job);
+            resumed = resumed || done != 0;
+            if (done == p_job->image.size) {
+                continue;
+            }
+            ret_code = plan_add_run(&p_ses->p_writes, &p_ses->n_writes, &p_ses->writes_cap,
+                    p_job->dst + done, p_job->image.size - done);
+            if (ret_code != 0) {
+                return ret_code;
+            }
+            continue;
+        }
+        /* only the sectors which differ */
+        ret_code = delta_plan(p_ses->p_ctx, p_job->image.p_data, p_job->image.size,
+                p_job->dst, p_ses->geom.sector_size, &p_delta_runs, &n_runs);
+        for (r = 0; r < n_runs && ret_code == 0; r++) {
+            ret_code = plan_add_run(&p_ses->p_writes, &p_ses->n_writes, &p_ses->writes_cap,
+                    p_delta_runs[r].addr, p_delta_runs[r].len);
+        }
+        free(p_delta_runs);
+        if (ret_code != 0) {
+            return ret_code;
+        }
+    }
+
+    /* a chip erase would throw away what is taken up */
+    if (resumed && p_ses->chip_erase == CHIP_ERASE_AUTO) {
+        p_ses->chip_erase = CHIP_ERASE_OFF;
+    }
+    /* the extents not kept are erased from here on */
+    if (journal_begin(&p_ses->p_ctx->journal) != 0) {
+        flash_log(p_ses->p_ctx, BL602_LOG_WARNING, "WARNING: unable to write the journal %s\n",
+                p_ses->p_ctx->journal.path);
+    }
+
+    /* the fewest, largest erases over all images */
+    return plan_erase(&p_ses->geom, p_ses->p_writes, p_ses->n_writes, &p_ses->p_erase,
+            &p_ses->n_erase);
+}
+
+/*
+ * With --chip-erase auto, the part of the flash the planned erases cover,
+ * in percent, from which a chip erase is done instead; it must also be
+ * faster by the worst case times. Whatever is outside the images is lost
+ * with it, so only when there is hardly anything left to lose.
+ */
+#define CHIP_ERASE_COVERAGE     90
+
+/* whether a chip erase is worth it for the planned erases, and why */
+static bool chip_erase_pays(flash_session_t *p_ses)
+{
+    const flash_geometry_t *p_geom = &p_ses->geom;
+    uint64_t covered = 0;
+    uint32_t flash_size = 0;
+    uint32_t erase_ms = 0;
+    uint32_t i = 0;
+
+    for (i = 0; i < p_ses->n_erase; i++) {
+        covered += p_ses->p_erase[i].len;
+        erase_ms += plan_erase_time_ms(p_geom, p_ses->p_erase[i].addr, p_ses->p_erase[i].len);
+    }
+    if (read_flash_size(p_ses->p_ctx, &flash_size) != 0 || flash_size == 0) {
+        flash_log(p_ses->p_ctx, BL602_LOG_INFO, "no chip erase: the flash size is unknown\n");
+        return false;
+    }
+    if (covered * 100 < (uint64_t)flash_size * CHIP_ERASE_COVERAGE) {
+        flash_log(p_ses->p_ctx, BL602_LOG_INFO, "no chip erase: the erases cover %llu of %u bytes, "
+                "under %u%%\n", (unsigned long long)covered, flash_size, CHIP_ERASE_COVERAGE);
+        return false;
+    }
+    if (erase_ms <= p_geom->time_chip_ms) {
+        flash_log(p_ses->p_ctx, BL602_LOG_INFO, "no chip erase: the erases take up to %u ms, "
+                "a chip erase up to %u ms\n", erase_ms, p_geom->time_chip_ms);
+        return false;
+    }
+    flash_log(p_ses->p_ctx, BL602_LOG_INFO, "chip erase: the erases cover %llu of %u bytes, "
+            "and take up to %u ms against %u ms\n", (unsigned long long)covered, flash_size,
+            erase_ms, p_geom->time_chip_ms);
+
+    return true;
+}
+
+/* phase 2: a chip erase if asked for or worth it, the planned erases otherwise */
+static int erase_planned(flash_session_t *p_ses)
+{
+    const flash_config_t *p_cfg = p_ses->p_cfg;
+    const flash_geometry_t *p_geom = &p_ses->geom;
+    int ret_code = 0;
+    uint32_t i = 0;
+
+    if (p_ses->chip_erase == CHIP_ERASE_AUTO && chip_erase_pays(p_ses)) {
+        p_ses->chip_erase = CHIP_ERASE_ON;
+    }
+    if (p_ses->chip_erase != CHIP_ERASE_ON) {
+        for (i = 0; i < p_ses->n_erase && ret_code == 0; i++) {
+            ret_code = erase_storage(p_ses->p_ctx, p_ses->p_erase[i].addr,
+                    p_ses->p_erase[i].len,
+                    plan_erase_time_ms(p_geom, p_ses->p_erase[i].addr, p_ses->p_erase[i].len));
+        }
+        return ret_code;
+    }
+
+    ret_code = erase_chip(p_ses->p_ctx, p_geom->time_chip_ms);
+    if (ret_code != 0) {
+        return ret_code;
+    }
+    /* everything is blank now, all the images are programmed in full */
+    p_ses->n_writes = 0;
+    for (i = 0; i < p_cfg->n_jobs && ret_code == 0; i++) {
+        ret_code = plan_add_run(&p_ses->p_writes, &p_ses->n_writes, &p_ses->writes_cap,
+                p_cfg->jobs[i].dst, p_cfg->jobs[i].image.size);
+    }
+    if (ret_code != 0) {
+        return ret_code;
+    }
+    free(p_ses->p_erase);
+    p_ses->p_erase = NULL;
+
+    return plan_erase(p_geom, p_ses->p_writes, p_ses->n_writes, &p_ses->p_erase,
+            &p_ses->n_erase);
+}
+
+/*
+ * phase 3: program what got erased of the current image; false if
+ * nothing of it was
+ */
+static int program_job(flash_session_t *p_ses, bool *p_programmed)
+{
+    const flash_job_t *p_job = &p_ses->p_cfg->jobs[p_ses->job];
+    flash_run_t *p_runs = p_ses->p_writes;     /* n_erase <= n_writes */
+    uint32_t n_runs = 0;
+    uint32_t len = 0;
+    uint32_t r = 0;
+    int ret_code = 0;
+
+    n_runs = plan_program(p_ses->p_erase, p_ses->n_erase, p_job->dst, p_job->image.size,
+            p_runs);
+    *p_programmed = (n_runs != 0);
+    if (n_runs != 0) {
+        flash_log(p_ses->p_ctx, BL602_LOG_INFO, "flashing *** %s ***\n", p_job->p_name);
+    }
+    for (r = 0; r < n_runs && ret_code == 0; r++) {
+        ret_code = program_run(p_ses->p_ctx, p_job, p_runs[r].addr, p_runs[r].len,
+                p_ses->p_cfg->compress, p_ses->flash_rate);
+        len += p_runs[r].len;
+    }
+    p_ses->p_ctx->stats.bytes_saved += p_job->image.size - len;
+
+    return ret_code;
+}
+
+/* the next image, or the end */
+static flash_state_t next_job(flash_session_t *p_ses)
+{
+    return (++p_ses->job < p_ses->p_cfg->n_jobs) ? FS_PROGRAM : FS_FINISH;
+}
+
+/* do what the session is at, and move it on */
+static int flash_step(flash_session_t *p_ses)
+{
+    const flash_config_t *p_cfg = p_ses->p_cfg;
+    bl602_session_t *p_ctx = p_ses->p_ctx;
+    int ret_code = 0;
+    bool programmed = false;
+
+    switch (p_ses->state) {
+    case FS_HAND_SHAKE:
+        ret_code = hand_shake(p_ctx, p_cfg->baud_rate);
+        p_ses->state = FS_BOOT_INFO;
+        break;
+    case FS_BOOT_INFO:
+        /* connection is established now */
+        ret_code = request_boot_info(p_ctx, &p_ses->boot_info);
+        p_ses->state = FS_BOOT_HEADER;
+        break;
+    case FS_BOOT_HEADER:
+        /*
+         * Before flashing the images, eflash image has to program to device. eflash is the
+         * program executed on device to handle all flash operations, including erase,
+         * program, etc.
+         *
+         * Though the protocol doc says eflash is not signed and encrypted in Chapter 2, the
+         * below source code is still programed based on protocol in Chapter 1 for
+         * completenecess.
+         *
+         * Also note: this boot header might be different from the one generated from
+         * efuse_bootheader_cfg.conf, just in case you are curious.
+         */
+        ret_code = load_boot_header(p_ctx, &p_cfg->eflash_loader);
+        p_ses->state = (p_ses->boot_info.sign != 0) ? FS_PUB_KEY : FS_AES_IV;
+        break;
+    case FS_PUB_KEY:
+        ret_code = load_pub_key(p_ctx);
+        p_ses->state = FS_SIGNATURE;
+        break;
+    case FS_SIGNATURE:
+        ret_code = load_signature(p_ctx);
+        p_ses->state = FS_AES_IV;
+        break;
+    case FS_AES_IV:
+        /* only if encrypted */
+        if (p_ses->boot_info.encrypted) {
+            ret_code = load_aes_iv(p_ctx);
+        }
+        p_ses->state = FS_SEGMENT_HEADER;
+        break;
+    case FS_SEGMENT_HEADER:
+        ret_code = load_segment_header(p_ctx, &p_cfg->eflash_loader);
+        p_ses->state = FS_SEGMENT_DATA;
+        break;
+    case FS_SEGMENT_DATA:
+        ret_code = load_segment_data(p_ctx, &p_cfg->eflash_loader);
+        p_ses->state = FS_CHECK_IMAGE;
+        break;
+    case FS_CHECK_IMAGE:
+        ret_code = check_image(p_ctx);
+        p_ses->state = FS_RUN_IMAGE;
+        break;
+    case FS_RUN_IMAGE:
+        ret_code = run_image(p_ctx);
+        if (ret_code == 0) {
+            /* the loader answers from now on, with the codes of its own */
+            p_ctx->boot_rom_stage = 0;
+        }
+        p_ses->state = FS_LOADER_HAND_SHAKE;
+        break;
+    case FS_LOADER_HAND_SHAKE:
+        /*
+         * At this point, the eflash image should be running, and ready to serve the
+         * flashing jobs. Shake hands to make sure it is OK.
+         */
+        if (p_ses->flash_rate > p_cfg->baud_rate) {
+            ret_code = climb_baud_ladder(p_ctx, p_cfg->baud_rate, p_ses->flash_rate,
+                    &p_ses->flash_rate);
+            if (ret_code == 0) {
+                flash_log(p_ses->p_ctx, BL602_LOG_INFO,
+                        "flashing with rate %u\n\n", p_ses->flash_rate);
+            }
+        } else {
+            p_ses->flash_rate = p_cfg->baud_rate;
+            ret_code = hand_shake(p_ctx, p_ses->flash_rate);
+        }
+        if (ret_code == 0) {
+            ret_code = probe_flash_payload(p_ctx, p_cfg->jobs[0].dst);
+        }
+        plan_geometry(&p_cfg->eflash_loader, &p_ses->geom);
+        p_ses->p_ctx->sector_size = p_ses->geom.sector_size;
+        p_ses->state = FS_PLAN;
+        break;
+    case FS_PLAN:
+        ret_code = plan_writes(p_ses);
+        p_ses->state = FS_ERASE;
+        break;
+    case FS_ERASE:
+        /* from now on p_writes holds the program runs of one image at a time */
+        ret_code = erase_planned(p_ses);
+        p_ses->job = 0;
+        p_ses->state = (p_cfg->n_jobs != 0) ? FS_PROGRAM : FS_FINISH;
+        break;
+    case FS_PROGRAM:
+        ret_code = program_job(p_ses, &programmed);
+        p_ses->state = programmed ? FS_PROGRAM_DONE : next_job(p_ses);
+        break;
+    case FS_PROGRAM_DONE:
+        ret_code = notify_flash_done(p_ctx);
+        p_ses->state = FS_VERIFY;
+        break;
+    case FS_VERIFY:
+        ret_code = send_sha256(p_ctx, (uint32_t *)p_cfg->jobs[p_ses->job].sha_256,
+                p_cfg->jobs[p_ses->job].dst, p_cfg->jobs[p_ses->job].image.size);
+        p_ses->state = next_job(p_ses);
+        break;
+    case FS_FINISH:
+        if (p_cfg->skip_unchanged || p_cfg->delta) {
+            flash_log(p_ses->p_ctx, BL602_LOG_INFO, "%llu bytes saved\n\n",
+                    (unsigned long long)p_ses->p_ctx->stats.bytes_saved);
+        }
+        ret_code = send_finish(p_ctx, 2000000);
+        if (ret_code == 0) {
+            flash_log(p_ses->p_ctx, BL602_LOG_INFO, "SUCCEED: flash completed\n");
+        } else {
+            flash_log(p_ses->p_ctx, BL602_LOG_ERROR, "ERROR: re-hand shake fail\n");
+        }
+        p_ses->state = FS_DONE;
+        break;
+    default:
+        ret_code = -1;
+        break;
+    }
+
+    return ret_code;
+}
+
+/*
+ * The whole session with the board on one port, one step after the
+ * other until done or a step fails. The time of each step is kept.
+ * The steps wait for the port in the loop of the session.
+ */
+int session_flash(bl602_session_t *p_ctx)
+{
+    const flash_config_t *p_cfg = p_ctx->p_cfg;
+    flash_session_t ses;
+    flash_state_t state = FS_HAND_SHAKE;
+    uint64_t start_us = 0;
+    uint64_t run_us = mono_time_us();
+    int ret_code = 0;
+
+    memset(&ses, 0, sizeof ses);
+    ses.p_ctx = p_ctx;
+    ses.p_cfg = p_cfg;
+    ses.state = FS_HAND_SHAKE;
+    ses.flash_rate = p_cfg->flash_rate;
+    ses.chip_erase = p_cfg->chip_erase;
+
+    memset(&p_ctx->stats, 0, sizeof p_ctx->stats);
+    p_ctx->boot_rom_stage = 1;
+    p_ctx->window = p_cfg->window;
+    p_ctx->uart_fd = uart_open(p_ctx->p_uart_port, p_cfg->baud_rate);
+    if (p_ctx->uart_fd < 0) {
+        flash_log(p_ctx, BL602_LOG_ERROR, "ERROR: failed to open UART %s\n", p_ctx->p_uart_port);
+        return -2;
+    }
+    p_ctx->baud_rate = p_cfg->baud_rate;
+    /* gaps between commands learned in the previous runs on this port */
+    pace_init(&p_ctx->pace, p_ctx->p_uart_port);
+    /* what a session which failed on this port got done */
+    journal_init(&p_ctx->journal, p_ctx->p_uart_port);
+    /* packet sizes found before with this loader */
+    pktsize_init(&p_ctx->pkt, p_cfg->loader_sha256);
+
+    while (ses.state != FS_DONE) {
+        state = ses.state;
+        if (p_ctx->step_cb != NULL) {
+            p_ctx->step_cb(p_ctx->p_step_user, state);
+        }
+        start_us = mono_time_us();
+        ret_code = flash_step(&ses);
+        p_ctx->stats.state_us[state] += mono_time_us() - start_us;
+        if (ret_code != 0) {
+            p_ctx->stats.p_failed_step = state_names[state];
+            flash_log(p_ctx, BL602_LOG_ERROR, "ERROR: %s failed at %s\n", p_ctx->p_uart_port,
+                    p_ctx->stats.p_failed_step);
+            break;
+        }
+    }
+    if (p_ctx->stats.resends != 0 || p_ctx->stats.rewrites != 0) {
+        flash_log(p_ctx, BL602_LOG_INFO,
+                "%s: %u packet(s) sent again, %u write error(s) recovered\n",
+                p_ctx->p_uart_port, p_ctx->stats.resends, p_ctx->stats.rewrites);
+    }
+#ifdef DEBUG
+    for (state = FS_HAND_SHAKE; state < FS_DONE; state++) {
+        flash_log(p_ctx, BL602_LOG_DEBUG,
+                "%s: %s %llu us\n", p_ctx->p_uart_port, state_names[state],
+                (unsigned long long)p_ctx->stats.state_us[state]);
+    }
+#endif
+
+    free(ses.p_erase);
+    free(ses.p_writes);
+    if (pace_save(&p_ctx->pace) != 0) {
+        flash_log(p_ctx, BL602_LOG_WARNING, "WARNING: unable to save pacing to %s\n",
+                p_ctx->pace.path);
+    }
+    if (pktsize_save(&p_ctx->pkt) != 0) {
+        flash_log(p_ctx, BL602_LOG_WARNING, "WARNING: unable to save packet sizes to %s\n",
+                p_ctx->pkt.path);
+    }
+    journal_end(&p_ctx->journal, ret_code == 0);
+    /* Close UART */
+    uart_close(p_ctx->uart_fd);
+    p_ctx->uart_fd = -1;
+    p_ctx->stats.elapsed_us = mono_time_us() - run_us;
+
+    return ret_code;
+}
+
+/* a loop of its own for the session, for the callers with one port */
+int bl602_session_run(bl602_session_t *p_ctx)
+{
+    bl602_loop_t *p_loop = bl602_loop_new();
+
+    if (p_loop == NULL) {
+        flash_log(p_ctx, BL602_LOG_ERROR, "ERROR: unable to create the loop of %s\n",
+                p_ctx->p_uart_port);
+        return -1;
+    }
+    if (bl602_loop_add(p_loop, p_ctx) == 0) {
+        (void) bl602_loop_run(p_loop);
+    }
+    bl602_loop_free(p_loop);
+
+    return p_ctx->io.ret_code;
+}
+
+bl602_session_t *bl602_session_new(const char *p_uart_port, const flash_config_t *p_cfg)
+{
+    bl602_session_t *p_ctx = calloc(1, sizeof(*p_ctx));
+
+    if (p_ctx == NULL) {
+        return NULL;
+    }
+    p_ctx->p_uart_port = strdup(p_uart_port);
+    if (p_ctx->p_uart_port == NULL) {
+        free(p_ctx);
+        return NULL;
+    }
+    p_ctx->p_cfg = p_cfg;
+    p_ctx->uart_fd = -1;
+    p_ctx->io.watched_fd = -1;
+    p_ctx->io.timer_fd = -1;
+    p_ctx->io.ret_code = -1;
+    p_ctx->boot_rom_stage = 1;
+    p_ctx->window = p_cfg->window;
+    p_ctx->sector_size = 4096;
+    p_ctx->resp_timeout_ms = SESSION_RESP_TIMEOUT_MS;
+    p_ctx->hand_shake_timeout_ms = SESSION_HAND_SHAKE_TIMEOUT_MS;
+
+    return p_ctx;
+}
+
+void bl602_session_free(bl602_session_t *p_ctx)
+{
+    if (p_ctx == NULL) {
+        return;
+    }
+    free(p_ctx->p_uart_port);
+    free(p_ctx);
+}
+
+void bl602_session_set_log(bl602_session_t *p_ctx, bl602_log_cb log_cb, void *p_user)
+{
+    p_ctx->log_cb = log_cb;
+    p_ctx->p_log_user = p_user;
+}
+
+void bl602_session_set_step(bl602_session_t *p_ctx, bl602_step_cb step_cb, void *p_user)
+{
+    p_ctx->step_cb = step_cb;
+    p_ctx->p_step_user = p_user;
+}
+
+void bl602_session_set_timeouts(bl602_session_t *p_ctx, uint32_t resp_ms,
+        uint32_t hand_shake_ms)
+{
+    if (resp_ms != 0) {
+        p_ctx->resp_timeout_ms = resp_ms;
+    }
+    if (hand_shake_ms != 0) {
+        p_ctx->hand_shake_timeout_ms = hand_shake_ms;
+    }
+}
+
+void bl602_session_stats(const bl602_session_t *p_ctx, bl602_stats_t *p_stats)
+{
+    *p_stats = p_ctx->stats;
+}
@@ -0,0 +1,65 @@
+/*
+ * flash BL 60x, the session behind libbl602flash
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <stdint.h>
+
+#include "bl602flash.h"
+#include "pacing.h"
+#include "pktsize.h"
+#include "journal.h"
+#include "loop.h"
+
+#define SESSION_RESP_TIMEOUT_MS         2000
+#define SESSION_HAND_SHAKE_TIMEOUT_MS   200
+
+struct bl602_session {
+    char *p_uart_port;
+    const flash_config_t *p_cfg;
+    int uart_fd;
+    uint32_t baud_rate;             /* the port is set to */
+    int boot_rom_stage;             /* the bootrom answers, not the loader */
+    uint32_t window;                /* flash data packets in flight */
+    uint32_t sector_size;           /* erased again after a write error */
+    uint32_t resp_timeout_ms;
+    uint32_t hand_shake_timeout_ms;
+    bl602_log_cb log_cb;
+    void *p_log_user;
+    bl602_step_cb step_cb;
+    void *p_step_user;
+    bl602_stats_t stats;
+    pace_t pace;                    /* the gaps learned on this port */
+    pktsize_t pkt;                  /* the packet sizes with this loader */
+    journal_t journal;              /* what the loader acked on this port */
+    session_io_t io;                /* what the session waits for in its loop */
+};
+
+/* the whole session with the board, on the stack of the session in its loop */
+int session_flash(bl602_session_t *p_ctx);
+
+/*
+ * to the log callback of p_ses, or to stdout/stderr without one; NULL
+ * for what is logged outside of any session
+ */
+void flash_log(const bl602_session_t *p_ses, int level, const char *p_fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif /* _SESSION_H */
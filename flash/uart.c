@@ -19,14 +19,25 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <termios.h>
 
+#include "uart.h"
+#include "loop.h"
+#include "session.h"
+
+/* the shortest step in waiting for the output to be sent */
+#define UART_SENT_POLL_US   200
+
 static int get_baud_rate(uint32_t baud_rate, speed_t *speed)
 {
     int ret_status = 0;
@@ -49,6 +60,21 @@ static int get_baud_rate(uint32_t baud_rate, speed_t *speed)
         case 230400:
             *speed = B230400;
             break;
+        case 460800:
+            *speed = B460800;
+            break;
+        case 921600:
+            *speed = B921600;
+            break;
+        case 1000000:
+            *speed = B1000000;
+            break;
+        case 1500000:
+            *speed = B1500000;
+            break;
+        case 2000000:
+            *speed = B2000000;
+            break;
         default:
             ret_status = -1;
             break;
@@ -57,44 +83,6 @@ static int get_baud_rate(uint32_t baud_rate, speed_t *speed)
     return ret_status;
 }
 
-#if 0
-/*
- * NOTE: checked on Ubuntu 18.04.6, this code seems not work.
- * set the baud rate to customer value, e.g. 200000, and check
- * against with the rate from:
- *    $stty -F /dev/ttyUSB0
- * #include <asm/termbits.h>
- *
- * directly including the asm/termios.h results in compiler error
- * due to conflict definition.
- */
-/*
- * https://www.downtowndougbrown.com/2013/11/linux-custom-serial-baud-rates/
- */
-int set_custom_baud_rate(int fd, uint32_t custom_baud) {
-    struct termios2 tio;
-
-    /* Get current settings */
-    if (ioctl(fd, TCGETS2, &tio) < 0) {
-        perror("TCGETS2");
-        return -1;
-    }
-
-    tio.c_cflag &= ~CBAUD;
-    tio.c_cflag |= BOTHER;       /* Allow custom baud */
-    tio.c_ispeed = custom_baud;  /* Input speed */
-    tio.c_ospeed = custom_baud;  /* Output speed */
-
-    /* Apply settings */
-    if (ioctl(fd, TCSETS2, &tio) < 0) {
-        perror("TCSETS2");
-        return -1;
-    }
-
-    return 0;
-}
-#endif
-
 int uart_open(const char *p_uart_port, uint32_t baud_rate)
 {
     int uart_fd;
@@ -102,24 +90,25 @@ int uart_open(const char *p_uart_port, uint32_t baud_rate)
     int ret_status;
     speed_t speed;
 
-    // Open the UART device file
-    uart_fd = open(p_uart_port, O_RDWR);
+    // Open the UART device file, all I/O is non-blocking and driven by poll()
+    uart_fd = open(p_uart_port, O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (uart_fd == -1) {
-        fprintf(stderr, "ERROR: Unable to open %s", p_uart_port);
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: Unable to open %s", p_uart_port);
+        return -1;
+    }
+    // Only a serial port, the daemon opens whatever path a client names
+    if (!isatty(uart_fd)) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: %s is not a tty\n", p_uart_port);
+        close(uart_fd);
         return -1;
     }
 
     // Configure UART settings
     tcgetattr(uart_fd, &options);
 
-    // Set baud rate
+    // Set baud rate, the rates out of the table are set with termios2 below
     ret_status = get_baud_rate(baud_rate, &speed);
-    if (ret_status < 0) {
-        fprintf(stderr, "ERROR: baud_rate not supported \n");
-        uart_fd = -2;
-        goto fail;
-    }
-    else {
+    if (ret_status == 0) {
         cfsetispeed(&options, speed);
         cfsetospeed(&options, speed);
     }
@@ -130,20 +119,224 @@ int uart_open(const char *p_uart_port, uint32_t baud_rate)
     options.c_cflag &= ~CSIZE;
     options.c_cflag |= CS8;     // 8 data bits
 
-    // Raw input mode
-    options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-    options.c_iflag &= ~(IXON | IXOFF | IXANY);
+    options.c_cflag |= (CLOCAL | CREAD);
+
+    // Raw input mode, binary responses must not be translated (e.g. CR to NL)
+    options.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHONL | ISIG | IEXTEN);
+    options.c_iflag &= ~(IXON | IXOFF | IXANY | ICRNL | INLCR | IGNCR
+            | ISTRIP | BRKINT | PARMRK);
     options.c_oflag &= ~OPOST;
+    options.c_cc[VMIN] = 0;
+    options.c_cc[VTIME] = 0;
 
     // Apply the settings
     tcsetattr(uart_fd, TCSANOW, &options);
+    if (ret_status != 0 && set_custom_baud_rate(uart_fd, baud_rate) != 0) {
+        flash_log(NULL, BL602_LOG_ERROR, "ERROR: baud_rate not supported \n");
+        close(uart_fd);
+        return -2;
+    }
+    tcflush(uart_fd, TCIOFLUSH);
 
-fail:
     return uart_fd;
 }
 
+/*
+ * switch the baud rate of an open port, the pending output is sent
+ * with the old rate first.
+ */
+int uart_set_baud_rate(int uart_fd, uint32_t baud_rate)
+{
+    struct termios options;
+    speed_t speed;
+
+    (void) tcdrain(uart_fd);
+    if (get_baud_rate(baud_rate, &speed) == 0) {
+        if (tcgetattr(uart_fd, &options) != 0) {
+            return -1;
+        }
+        cfsetispeed(&options, speed);
+        cfsetospeed(&options, speed);
+        if (tcsetattr(uart_fd, TCSANOW, &options) != 0) {
+            return -1;
+        }
+    } else if (set_custom_baud_rate(uart_fd, baud_rate) != 0) {
+        return -1;
+    }
+    tcflush(uart_fd, TCIFLUSH);
+
+    return 0;
+}
+
 int uart_close(int uart_fd)
 {
     close(uart_fd);
     return 0;
 }
+
+uint64_t mono_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * write the whole buffer, looping on short writes.
+ * Return 0 on success, -1 on error or timeout.
+ */
+int uart_write_all(bl602_session_t *p_ses, const void *p_buf, size_t len, uint32_t timeout_ms)
+{
+    int uart_fd = p_ses->uart_fd;
+    const uint8_t *p_curr = (const uint8_t *)p_buf;
+    uint64_t deadline = mono_time_us() + (uint64_t)timeout_ms * 1000;
+    ssize_t bytes_n;
+
+    while (len > 0) {
+        bytes_n = write(uart_fd, p_curr, len);
+        if (bytes_n > 0) {
+            p_curr += bytes_n;
+            len -= bytes_n;
+            continue;
+        }
+        if (bytes_n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        /* kernel buffer is full, wait until it drains */
+        if (session_wait(p_ses, POLLOUT, deadline) <= 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * gather write of the whole iov array, looping on short writes.
+ * NOTE: iov is consumed, i.e. modified in place.
+ * Return 0 on success, -1 on error or timeout.
+ */
+int uart_writev_all(bl602_session_t *p_ses, struct iovec *iov, int iov_cnt,
+        uint32_t timeout_ms)
+{
+    int uart_fd = p_ses->uart_fd;
+    uint64_t deadline = mono_time_us() + (uint64_t)timeout_ms * 1000;
+    ssize_t bytes_n;
+
+    while (iov_cnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iov_cnt--;
+            continue;
+        }
+        bytes_n = writev(uart_fd, iov, iov_cnt);
+        if (bytes_n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            /* kernel buffer is full, wait until it drains */
+            if (session_wait(p_ses, POLLOUT, deadline) <= 0) {
+                return -1;
+            }
+            continue;
+        }
+        /* skip what is written */
+        while (iov_cnt > 0 && bytes_n >= (ssize_t)iov->iov_len) {
+            bytes_n -= iov->iov_len;
+            iov++;
+            iov_cnt--;
+        }
+        if (iov_cnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + bytes_n;
+            iov->iov_len -= bytes_n;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * read whatever is available, up to len bytes, waiting at most
+ * timeout_ms for the first byte.
+ * Return the number of bytes read, 0 on timeout, -1 on error.
+ */
+ssize_t uart_read_timeout(bl602_session_t *p_ses, void *p_buf, size_t len, uint32_t timeout_ms)
+{
+    int uart_fd = p_ses->uart_fd;
+    uint64_t deadline = mono_time_us() + (uint64_t)timeout_ms * 1000;
+    ssize_t bytes_n;
+    int ret;
+
+    while (1) {
+        bytes_n = read(uart_fd, p_buf, len);
+        if (bytes_n > 0) {
+            return bytes_n;
+        }
+        if (bytes_n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        ret = session_wait(p_ses, POLLIN, deadline);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+}
+
+/*
+ * wait until the output queue is on the wire, as tcdrain() does, but
+ * in steps of about the time the queued bytes take at the rate of the
+ * port, so that the session waits in its loop instead of the thread.
+ * Return 0 once sent, -1 on timeout.
+ */
+int uart_wait_sent(bl602_session_t *p_ses, uint32_t timeout_ms)
+{
+    uint64_t deadline = mono_time_us() + (uint64_t)timeout_ms * 1000;
+    uint64_t now = 0;
+    uint64_t wire_us = 0;
+    int queued = 0;
+
+    /* a driver without the count has nothing to wait for */
+    while (ioctl(p_ses->uart_fd, TIOCOUTQ, &queued) == 0 && queued > 0) {
+        now = mono_time_us();
+        if (now >= deadline) {
+            return -1;
+        }
+        /* 8N1, 10 bits a byte */
+        wire_us = (uint64_t)queued * 10 * 1000000 / (p_ses->baud_rate ? p_ses->baud_rate : 115200);
+        if (wire_us < UART_SENT_POLL_US) {
+            wire_us = UART_SENT_POLL_US;
+        }
+        session_sleep_until(p_ses, (now + wire_us < deadline) ? now + wire_us : deadline);
+    }
+
+    return 0;
+}
+
+/*
+ * discard stray bytes in the receive path, e.g. the left over of
+ * a previous response or the echo of hand shake.
+ * Return the number of bytes discarded.
+ */
+uint32_t uart_drain_input(int uart_fd)
+{
+    uint8_t junk[256];
+    uint32_t drained = 0;
+    ssize_t bytes_n;
+
+    tcflush(uart_fd, TCIFLUSH);
+    while ((bytes_n = read(uart_fd, junk, sizeof junk)) > 0) {
+        drained += bytes_n;
+    }
+
+    return drained;
+}
@@ -20,11 +20,34 @@
 #ifndef _UART_H
 #define _UART_H
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "bl602flash.h"
+
 int uart_open(const char *p_uart_port, uint32_t baud_rate);
 int uart_close(int uart_id);
 
-#if 0
+/* monotonic clock in micro seconds */
+uint64_t mono_time_us(void);
+
+/* on the fd of p_ses, the waits go to the loop the session is in */
+int uart_write_all(bl602_session_t *p_ses, const void *p_buf, size_t len, uint32_t timeout_ms);
+
+int uart_writev_all(bl602_session_t *p_ses, struct iovec *iov, int iov_cnt,
+        uint32_t timeout_ms);
+
+ssize_t uart_read_timeout(bl602_session_t *p_ses, void *p_buf, size_t len, uint32_t timeout_ms);
+
+/* the output queued so far is on the wire */
+int uart_wait_sent(bl602_session_t *p_ses, uint32_t timeout_ms);
+
+uint32_t uart_drain_input(int uart_fd);
+
+/* any rate the driver accepts, through termios2 (BOTHER) */
 int set_custom_baud_rate(int fd, uint32_t custom_baud);
-#endif
+
+int uart_set_baud_rate(int uart_fd, uint32_t baud_rate);
 
 #endif /* _UART_H */
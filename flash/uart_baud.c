@@ -0,0 +1,69 @@
+/*
+ * uart utility, arbitrary baud rate
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * NOTE: asm/termbits.h conflicts with termios.h of libc, so the
+ * termios2 code lives in its own translation unit, and nothing here
+ * may include termios.h (uart.h does not).
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+#include "uart.h"
+#include "session.h"
+
+/*
+ * https://www.downtowndougbrown.com/2013/11/linux-custom-serial-baud-rates/
+ * set the baud rate to customer value, e.g. 2000000, and check
+ * against with the rate from:
+ *    $stty -F /dev/ttyUSB0
+ */
+int set_custom_baud_rate(int fd, uint32_t custom_baud) {
+    struct termios2 tio;
+
+    /* Get current settings */
+    if (ioctl(fd, TCGETS2, &tio) < 0) {
+        flash_log(NULL, BL602_LOG_ERROR, "TCGETS2: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* both output and input speed come from c_ospeed/c_ispeed */
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);  /* Allow custom baud */
+    tio.c_ispeed = custom_baud;  /* Input speed */
+    tio.c_ospeed = custom_baud;  /* Output speed */
+
+    /* Apply settings */
+    if (ioctl(fd, TCSETS2, &tio) < 0) {
+        flash_log(NULL, BL602_LOG_ERROR, "TCSETS2: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* the driver may round it to what the hardware can do */
+    if (ioctl(fd, TCGETS2, &tio) == 0 && tio.c_ospeed != custom_baud) {
+        flash_log(NULL, BL602_LOG_INFO, "baud rate %u is set as %u\n", custom_baud, tio.c_ospeed);
+    }
+
+    return 0;
+}
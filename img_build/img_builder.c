@@ -33,6 +33,7 @@
 #include "packet_comm.h"
 #include "common_share.h"
 #include "crypto.h"
+#include "crc32.h"
 
 
 #define SFC_TABLE_E(var, alias, type) {#var, #alias, offsetof(type, var) \
@@ -0,0 +1,38 @@
+/*
+ * CRC32 (IEEE 802.3, the one of zlib)
+ *
+ * Copyright (C) 2025, Liang Cheng
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * same semantics as crc32() of zlib: start with crc = 0, and feed the
+ * returned value back to continue with the next piece of data
+ */
+uint32_t crc32_update(uint32_t crc, const void *p_data, size_t len);
+
+/* one shot of the above */
+uint32_t calc_crc32(const char *src, uint32_t sz);
+
+/* name of the implementation picked for this CPU, e.g. "pclmul" */
+const char *crc32_backend(void);
+
+#endif /* _CRC32_H */
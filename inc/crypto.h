@@ -27,8 +27,26 @@
 #define _CRYPTO_H
 
 #include <stdint.h>
+#include <stddef.h>
 
-void calc_sha256(uint8_t *p_msg, uint32_t len, uint32_t *p_sha);
+/* incremental hashing, memory use does not depend on the message size */
+typedef struct {
+    uint32_t H[8];
+    uint64_t len;
+    uint8_t buf[64];
+    uint32_t buf_len;
+} sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t *p_ctx);
+
+void sha256_update(sha256_ctx_t *p_ctx, const void *p_data, size_t len);
+
+void sha256_final(sha256_ctx_t *p_ctx, uint32_t *p_sha);
+
+/* one shot of the above */
+void calc_sha256(const uint8_t *p_msg, uint32_t len, uint32_t *p_sha);
+
+/* name of the implementation picked for this CPU, e.g. "sha-ni" */
+const char *sha256_backend(void);
 
-uint32_t calc_crc32(const char *src, uint32_t sz);
 #endif /* _CRYPTO_H */
@@ -38,8 +38,11 @@ typedef enum {
     COMMAND_IMG_RUN     = 0x1A,
     COMMAND_ERASE_FLASH = 0x30,
     COMMAND_FLASH_DATA  = 0x31,
+    COMMAND_READ_JID    = 0x36,
     COMMAND_PROG_OK     = 0x3A,
-    COMMAND_SHA_256     = 0x3D
+    COMMAND_CHIP_ERASE  = 0x3C,
+    COMMAND_SHA_256     = 0x3D,
+    COMMAND_FLASH_XZ    = 0x3F
 
 } COMMAND_ID;
 
@@ -114,10 +117,15 @@ typedef struct {
  * BL602_ISP_protocol says: 4096 is the limitation of protocol frame size.
  * If larger, send multiple data to send
  * NOTE: test shows that above is not true.
+ * The payload sent is probed at run time (flash/pktsize.h), up to the
+ * room here.
  */
+#define SEG_DATA_MAX        4096
+#define FLASH_DATA_MAX      (16 * 1024)
+
 typedef struct {
     packet_hdr_t seg_data_hdr;
-    uint8_t seg_data[2048];
+    uint8_t seg_data[SEG_DATA_MAX];
 } segment_data_pkt_t;
 
 /* image check */
@@ -130,6 +138,16 @@ typedef struct {
     packet_hdr_t img_run_hdr;
 } image_run_pkt_t;
 
+/* chip erase */
+typedef struct {
+    packet_hdr_t chip_erase_hdr;
+} chip_erase_pkt_t;
+
+/* read the JEDEC id of the flash */
+typedef struct {
+    packet_hdr_t read_jid_hdr;
+} read_jid_pkt_t;
+
 /* erase command */
 typedef struct {
     packet_hdr_t erase_hdr;
@@ -149,7 +167,7 @@ typedef struct {
         };
     };
     uint32_t addr;
-    uint8_t data[8 * 1024];
+    uint8_t data[FLASH_DATA_MAX];
 } flash_data_pkt_t;
 
 /* flash done */
@@ -201,6 +219,12 @@ typedef struct __attribute__ ((__packed__)){
             uint8_t len_msb_s;
             uint32_t sha256[8];
         };
+        struct {
+            uint8_t result_j[2]; /* place holder */
+            uint8_t len_lsb_j;
+            uint8_t len_msb_j;
+            uint8_t jid[4];     /* manufacturer, type, capacity, 0 */
+        };
     };
 } bl_resp_t;
 
@@ -27,6 +27,7 @@
 #include <string.h>
 #include "common_share.h"
 #include "partition.h"
+#include "crc32.h"
 
 struct offset_table_t {
     const char *field_name;
@@ -68,36 +69,6 @@ static bool is_empty_line(char *buf) {
     return has_nothing;
 }
 
-/*
- * https://zlib.net/crc_v3.txt
- * for fun:
- * https://stackoverflow.com/questions/2587766/how-is-a-crc32-checksum-calculated
- */
-static uint32_t calc_crc32(const char *src, uint32_t sz)
-{
-    char ch;
-    uint32_t crc = ~0;
-    uint32_t i = 0;
-    uint32_t j = 0;
-    uint32_t b = 0;
-
-    printf("crc = 0x%x\n", crc);
-    for(i = 0; i < sz; i++) {
-        ch = src[i];
-        for(j = 0; j < 8; j++) {
-            b = (ch ^ crc) & 1;
-            crc >>= 1;
-            if (b) {
-                crc=crc^0xEDB88320;
-            }
-            ch >>= 1;
-        }
-    }
-
-    printf("crc = %x\n", ~crc);
-    return ~crc;
-}
-
 /*
  * The customized parser to handle the partition configuration
  * in toml format. Intended to fullfill the need without dependency.
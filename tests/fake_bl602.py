@@ -0,0 +1,272 @@
+#!/usr/bin/env python3
+#
+# A BL 60x on a pseudo terminal: the bootrom, then the eflash loader,
+# with a flash held in a file. Enough of the protocol for the flash tool
+# to run a whole session against it, no board needed.
+#
+# Copyright (C) 2025, Liang Cheng
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+# usage: fake_bl602.py --link tty_path --flash flash.bin --stats stats.json
+#            [--seg-max n] [--flash-max n] [--size n]
+#
+# The slave side of the pty is linked at tty_path, for --uart. The flash
+# is loaded from, and saved back to, flash.bin (all 0xFF if it does not
+# exist). On SIGTERM, what the tool did is written to stats.json: the
+# commands by id, the bytes programmed, the erases, and so on.
+
+import argparse
+import hashlib
+import json
+import lzma
+import os
+import pty
+import select
+import signal
+import struct
+import sys
+import time
+import tty
+
+CMD_LEN_ERROR = 0x0102
+CMD_ID_ERROR = 0x0101
+CMD_CRC_ERROR = 0x0103
+SECTIONDATA_TLEN_ERROR = 0x0214
+
+BOOT_INFO = 0x10
+BOOT_HDR = 0x11
+SEG_HDR = 0x17
+SEG_DATA = 0x18
+IMG_CHECK = 0x19
+IMG_RUN = 0x1A
+ERASE_FLASH = 0x30
+FLASH_DATA = 0x31
+READ_JID = 0x36
+PROG_OK = 0x3A
+CHIP_ERASE = 0x3C
+SHA_256 = 0x3D
+FLASH_XZ = 0x3F
+
+SECTOR = 4096
+
+
+class Device:
+    def __init__(self, args):
+        self.args = args
+        self.flash = bytearray(b'\xff' * args.size)
+        if os.path.exists(args.flash):
+            with open(args.flash, 'rb') as f:
+                data = f.read()
+            self.flash[:len(data)] = data[:args.size]
+        self.seg_expect = 0
+        self.seg_got = 0
+        self.xz = None
+        self.xz_addr = 0
+        self.stats = {
+            'hand_shakes': 0,
+            'commands': {},
+            'seg_bytes': 0,
+            'seg_packets': 0,
+            'seg_refused': 0,
+            'image_check': None,
+            'flash_bytes': 0,
+            'flash_packets': 0,
+            'flash_refused': 0,
+            'crc_errors': 0,
+            'xz_bytes': 0,
+            'xz_out_bytes': 0,
+            'xz_left_over': 0,
+            'erases': [],
+            'erased_bytes': 0,
+            'chip_erases': 0,
+            'jid_reads': 0,
+            'prog_ok': 0,
+            'sha_requests': 0,
+        }
+
+    def save(self):
+        tmp = self.args.flash + '.tmp'
+        with open(tmp, 'wb') as f:
+            f.write(self.flash)
+        os.replace(tmp, self.args.flash)
+        with open(self.args.stats, 'w') as f:
+            json.dump(self.stats, f, indent=1, sort_keys=True)
+
+    def program(self, addr, data):
+        end = min(addr + len(data), len(self.flash))
+        for i in range(addr, end):
+            # programming only clears bits
+            self.flash[i] &= data[i - addr]
+        # a bad cell: the byte reads back with its lowest bit flipped
+        if addr <= self.args.flip_bit < end:
+            self.flash[self.args.flip_bit] ^= 1
+
+    # one command, the answer is returned
+    def command(self, cmd, crc, payload):
+        st = self.stats
+        key = '0x%02x' % cmd
+        st['commands'][key] = st['commands'].get(key, 0) + 1
+        # the loader checks the sum over the length and the payload of data
+        if cmd in (FLASH_DATA, FLASH_XZ):
+            length = len(payload)
+            if (length + (length >> 8) + sum(payload)) & 0xff != crc:
+                st['crc_errors'] += 1
+                return fail(CMD_CRC_ERROR)
+        if cmd == BOOT_INFO:
+            return ok(struct.pack('<I', 1) + bytes(16))
+        if cmd == BOOT_HDR:
+            return ok()
+        if cmd == SEG_HDR:
+            self.seg_expect = struct.unpack('<I', payload[4:8])[0]
+            self.seg_got = 0
+            return ok(payload)
+        if cmd == SEG_DATA:
+            if len(payload) > self.args.seg_max:
+                st['seg_refused'] += 1
+                return fail(CMD_LEN_ERROR)
+            self.seg_got += len(payload)
+            st['seg_bytes'] += len(payload)
+            st['seg_packets'] += 1
+            return ok()
+        if cmd == IMG_CHECK:
+            st['image_check'] = [self.seg_got, self.seg_expect]
+            if self.seg_got != self.seg_expect:
+                return fail(SECTIONDATA_TLEN_ERROR)
+            return ok()
+        if cmd == IMG_RUN:
+            return ok()
+        if cmd == ERASE_FLASH:
+            start, end = struct.unpack('<II', payload[:8])
+            # whole sectors, the end address is inclusive
+            start -= start % SECTOR
+            end = (end // SECTOR + 1) * SECTOR
+            self.flash[start:end] = b'\xff' * (end - start)
+            st['erases'].append([start, end - start])
+            st['erased_bytes'] += end - start
+            return ok()
+        if cmd == CHIP_ERASE:
+            self.flash[:] = b'\xff' * len(self.flash)
+            st['chip_erases'] += 1
+            return ok()
+        if cmd == FLASH_DATA:
+            if len(payload) - 4 > self.args.flash_max:
+                st['flash_refused'] += 1
+                return fail(CMD_LEN_ERROR)
+            addr = struct.unpack('<I', payload[:4])[0]
+            self.program(addr, payload[4:])
+            st['flash_bytes'] += len(payload) - 4
+            st['flash_packets'] += 1
+            return ok()
+        if cmd == FLASH_XZ:
+            if len(payload) - 4 > self.args.flash_max:
+                st['flash_refused'] += 1
+                return fail(CMD_LEN_ERROR)
+            if self.xz is None:
+                self.xz = bytearray()
+                self.xz_addr = struct.unpack('<I', payload[:4])[0]
+            self.xz += payload[4:]
+            st['xz_bytes'] += len(payload) - 4
+            return ok()
+        if cmd == READ_JID:
+            # a Winbond part, the capacity byte is log2 of the size
+            st['jid_reads'] += 1
+            return ok(bytes([0xef, 0x40, len(self.flash).bit_length() - 1, 0]))
+        if cmd == PROG_OK:
+            st['prog_ok'] += 1
+            if self.xz is not None:
+                # a single stream decoder, as the loader's: what follows
+                # the first stream is left over
+                dec = lzma.LZMADecompressor(format=lzma.FORMAT_XZ)
+                out = dec.decompress(bytes(self.xz))
+                self.program(self.xz_addr, out)
+                st['xz_out_bytes'] += len(out)
+                st['xz_left_over'] += len(dec.unused_data)
+                self.xz = None
+            return ok()
+        if cmd == SHA_256:
+            start, size = struct.unpack('<II', payload[:8])
+            st['sha_requests'] += 1
+            return ok(hashlib.sha256(bytes(self.flash[start:start + size])).digest())
+        return fail(CMD_ID_ERROR)
+
+
+def ok(payload=None):
+    if payload is None:
+        return b'OK'
+    return b'OK' + struct.pack('<H', len(payload)) + payload
+
+
+def fail(code):
+    return b'FL' + struct.pack('<H', code)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--link', required=True)
+    parser.add_argument('--flash', required=True)
+    parser.add_argument('--stats', required=True)
+    parser.add_argument('--size', type=int, default=2 * 1024 * 1024)
+    parser.add_argument('--seg-max', type=int, default=4096)
+    parser.add_argument('--flash-max', type=int, default=8192)
+    parser.add_argument('--flip-bit', type=lambda s: int(s, 0), default=-1)
+    args = parser.parse_args()
+
+    dev = Device(args)
+    master, slave = pty.openpty()
+    tty.setraw(slave)
+    if os.path.lexists(args.link):
+        os.unlink(args.link)
+    os.symlink(os.ttyname(slave), args.link)
+
+    def stop(signum, frame):
+        dev.save()
+        os.unlink(args.link)
+        sys.exit(0)
+    signal.signal(signal.SIGTERM, stop)
+    signal.signal(signal.SIGINT, stop)
+    print(os.ttyname(slave), flush=True)
+
+    buf = bytearray()
+    while True:
+        r, _, _ = select.select([master], [], [], 0.005)
+        if r:
+            try:
+                buf += os.read(master, 65536)
+            except OSError:
+                # the tool closed the port, wait for it to come back
+                time.sleep(0.01)
+                continue
+        # a run of 0x55 is a hand shake, answered once it stops
+        if buf and buf[0] == 0x55:
+            while buf and buf[0] == 0x55:
+                buf.pop(0)
+            if not r or buf:
+                dev.stats['hand_shakes'] += 1
+                os.write(master, ok())
+            else:
+                buf[0:0] = b'\x55'
+            continue
+        while len(buf) >= 4 and buf[0] != 0x55:
+            cmd, crc, length = buf[0], buf[1], buf[2] | buf[3] << 8
+            if len(buf) < 4 + length:
+                break
+            payload = bytes(buf[4:4 + length])
+            del buf[:4 + length]
+            os.write(master, dev.command(cmd, crc, payload))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,249 @@
+#!/bin/bash
+#
+# Flash the images of image_and_config to the fake device (fake_bl602.py)
+# and check what the device got, for each way of flashing. Run from the
+# top of the tree after make, or with make test.
+#
+# Copyright (C) 2025, Liang Cheng
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+BIN=$TOP/bin
+FAKE=$TOP/tests/fake_bl602.py
+WORK=$(mktemp -d /tmp/bl602_test.XXXXXX)
+# the caches of the tool (pacing, packet sizes, journal) start empty
+export HOME=$WORK/home
+mkdir -p "$HOME"
+
+n_pass=0
+n_fail=0
+fake_pids=
+daemon_pid=
+
+cleanup() {
+    stop_fake
+    [ -n "$daemon_pid" ] && kill "$daemon_pid" 2> /dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# start_fake name flash [fake options]: a device of its own per test, with
+# the flash kept in the file flash (blank if it does not exist); TTY, FLASH
+# and STATS are those of the last device started
+start_fake() {
+    local name=$1
+    FLASH=$2
+    shift 2
+    TTY=$WORK/tty_$name
+    STATS=$WORK/stats_$name.json
+    python3 "$FAKE" --link "$TTY" --flash "$FLASH" --stats "$STATS" "$@" > /dev/null &
+    fake_pids="$fake_pids $!"
+    while [ ! -e "$TTY" ]; do
+        sleep 0.05
+    done
+}
+
+# stop all the devices started
+stop_fake() {
+    local pid
+    for pid in $fake_pids; do
+        kill "$pid" 2> /dev/null
+        wait "$pid" 2> /dev/null
+    done
+    fake_pids=
+}
+
+# flash_board bundle [flash options]: on the last device, --uart adds others
+flash_board() {
+    local bundle=$1
+    shift
+    "$BIN/flash" --uart "$TTY" --rate 230400 --bundle "$bundle" "$@" > "$WORK/out.txt" 2>&1
+}
+
+# stat expr: a python expression over the stats s of the last device
+stat() {
+    python3 -c "import json; s = json.load(open('$STATS')); print($1)"
+}
+
+# images_in_flash bundle [flash]: the images of the bundle are at their
+# place in flash, that of the last device by default
+images_in_flash() {
+    python3 - "$1" "${2:-$FLASH}" << 'EOF'
+import struct, sys
+bundle = open(sys.argv[1], 'rb').read()
+flash = open(sys.argv[2], 'rb').read()
+for line in open(sys.argv[1] + '.plan'):
+    name, dst, path = line.split()
+    data = open(path, 'rb').read()
+    if flash[int(dst, 16):int(dst, 16) + len(data)] != data:
+        print('%s is not at %s' % (name, dst))
+        sys.exit(1)
+EOF
+}
+
+check() {
+    local what=$1
+    shift
+    if "$@"; then
+        n_pass=$((n_pass + 1))
+        echo "PASS: $what"
+    else
+        n_fail=$((n_fail + 1))
+        echo "FAIL: $what"
+        sed 's/^/    /' "$WORK/out.txt" | tail -20
+    fi
+}
+
+is() {
+    [ "$(stat "$1")" = "$2" ]
+}
+
+fails() {
+    ! "$@"
+}
+
+# make_bundle bundle fw: the images of image_and_config, with fw as the firmware
+make_bundle() {
+    local bundle=$1
+    local fw=$2
+    (cd "$WORK" && "$BIN/partition_gen" -i "$TOP/image_and_config/partition_cfg_2M.toml" \
+        -o partition.bin > /dev/null)
+    # any bytes do as the dtb for the fake device
+    cp "$TOP/image_and_config/bl_factory_params_IoTKitA_40M.dts" "$WORK/ro_params.dtb"
+    "$BIN/flash" --make-bundle "$bundle" --partition "$WORK/partition.bin@0xe000" \
+        "$WORK/partition.bin@0xf000" --fw "$fw" --dtb "$WORK/ro_params.dtb" \
+        --eflash "$BIN/eflash_loader_40m.bin" --boot2 "$BIN/blsp_boot2.bin" \
+        > "$WORK/out.txt" 2>&1 || return 1
+    # where each image went, for images_in_flash
+    sed -n 's/^plan: \(.*\) to \[\(0x[0-9a-f]*\), .*/\1 \2/p' "$WORK/out.txt" |
+        while read -r name dst; do
+            echo "$name $dst $name"
+        done > "$bundle.plan"
+}
+
+cd "$WORK" || exit 1
+cp "$BIN/fwimage.bin" "$WORK/fw.bin"
+make_bundle "$WORK/a.bundle" "$WORK/fw.bin" || { cat "$WORK/out.txt"; exit 1; }
+
+# a board flashed in full, nothing known about it yet
+start_fake full "$WORK/flash_a.bin"
+check "full flash" flash_board "$WORK/a.bundle"
+stop_fake
+check "a refused probe is a loader error" grep -q "EFLASH_LOADER_CMD_LEN_ERROR" "$WORK/out.txt"
+check "the loader is taken whole on the first run" is "s['image_check'][0] == s['image_check'][1]" True
+check "the images are in the flash" images_in_flash "$WORK/a.bundle"
+check "one program done per image" is "s['prog_ok']" 5
+check "the checksums of the data packets hold" is "s['crc_errors']" 0
+check "no chip erase" is "s['chip_erases']" 0
+
+# the same images again, nothing of them is sent
+start_fake skip "$WORK/flash_a.bin"
+check "skip unchanged flash" flash_board "$WORK/a.bundle" --skip-unchanged
+stop_fake
+check "no flash data sent" is "s['flash_bytes'] + s['xz_bytes']" 0
+check "no erase" is "s['erased_bytes'] + s['chip_erases']" 0
+check "the images are still in the flash" images_in_flash "$WORK/a.bundle"
+
+# a blank board, the images sent as xz streams
+start_fake xz "$WORK/flash_xz.bin"
+check "compressed flash" flash_board "$WORK/a.bundle" --compress
+stop_fake
+check "xz streams sent" is "s['xz_bytes'] > 0" True
+check "each image is a single xz stream" is "s['xz_left_over']" 0
+check "one program done per image, compressed or not" is "s['prog_ok']" 5
+check "the images are in the flash" images_in_flash "$WORK/a.bundle"
+
+# the sample images cover a small part of the flash, the rest is kept
+python3 -c "open('$WORK/flash_auto.bin', 'wb').write(b'\xa5' * (2 * 1024 * 1024))"
+start_fake auto "$WORK/flash_auto.bin"
+check "chip erase auto" flash_board "$WORK/a.bundle" --chip-erase auto
+stop_fake
+check "the flash size is read" is "s['jid_reads']" 1
+check "no chip erase for a small coverage" is "s['chip_erases']" 0
+check "the images are in the flash" images_in_flash "$WORK/a.bundle"
+check "the flash past the images is kept" python3 -c \
+    "import sys; sys.exit(open('$FLASH', 'rb').read()[-4096:] != b'\xa5' * 4096)"
+
+# one sector of the firmware changed on the board flashed in full
+python3 - "$WORK/fw.bin" "$WORK/fw2.bin" << 'EOF2'
+import sys
+fw = bytearray(open(sys.argv[1], 'rb').read())
+fw[20000:20016] = bytes(16)
+open(sys.argv[2], 'wb').write(fw)
+EOF2
+make_bundle "$WORK/b.bundle" "$WORK/fw2.bin"
+start_fake delta "$WORK/flash_a.bin"
+check "delta flash" flash_board "$WORK/b.bundle" --delta
+stop_fake
+check "a single sector erased" is "s['erased_bytes']" 4096
+check "a single sector programmed" is "s['flash_bytes'] + s['xz_bytes'] <= 4096" True
+check "the new images are in the flash" images_in_flash "$WORK/b.bundle"
+
+# a bad cell in the partition table, the board must not pass
+start_fake flip "$WORK/flash_flip.bin" --flip-bit 0xe010
+check "a flash which does not hold the image fails" fails flash_board "$WORK/a.bundle"
+stop_fake
+check "the board fails at verify" grep -q "failed at verify" "$WORK/out.txt"
+
+# two boards at once, both ports driven by the loop of one thread
+start_fake two_a "$WORK/flash_two_a.bin"
+tty_a=$TTY
+flash_a=$FLASH
+start_fake two_b "$WORK/flash_two_b.bin"
+check "two boards at once" flash_board "$WORK/a.bundle" --uart "$tty_a"
+stop_fake
+check "both boards flashed" grep -q "^2 of 2 boards flashed" "$WORK/out.txt"
+check "the images are in the flash of the first board" images_in_flash "$WORK/a.bundle" "$flash_a"
+check "the images are in the flash of the second board" images_in_flash "$WORK/a.bundle"
+
+# the daemon: jobs on its socket, the socket closed to others
+"$BIN/flash" --daemon "$WORK/d.sock" --plan a="$WORK/a.bundle" > "$WORK/daemon.txt" 2>&1 &
+daemon_pid=$!
+while [ ! -S "$WORK/d.sock" ]; do
+    sleep 0.05
+done
+# request line: the answer of the daemon to one request
+request() {
+    python3 - "$WORK/d.sock" "$1" << 'EOF'
+import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(sys.argv[2].encode() + b'\n')
+while True:
+    data = s.recv(4096)
+    if not data:
+        break
+    sys.stdout.write(data.decode())
+EOF
+}
+# answer regex request: the last line of the answer matches regex
+answer() {
+    request "$2" > "$WORK/out.txt"
+    tail -1 "$WORK/out.txt" | grep -q "$1"
+}
+check "the daemon socket is not open to others" \
+    [ "$(python3 -c "import os; print(oct(os.stat('$WORK/d.sock').st_mode & 0o777))")" = 0o660 ]
+check "the daemon refuses a port which is not a tty" answer "^fail .* start$" "flash $WORK/a.bundle a"
+start_fake daemon "$WORK/flash_daemon.bin"
+check "the daemon flashes a board" answer "^ok " "flash $TTY a"
+stop_fake
+check "the images are in the flash of the board of the daemon" images_in_flash "$WORK/a.bundle"
+kill "$daemon_pid" 2> /dev/null
+wait "$daemon_pid" 2> /dev/null
+daemon_pid=
+
+echo "$n_pass passed, $n_fail failed"
+[ "$n_fail" -eq 0 ]